@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "ecs.hpp"
+
+// Prints nanoseconds per entity for every benchmark and entity count. Every measurement is the
+// minimum of a number of repetitions, so the table is reasonably stable between runs and can be
+// diffed between commits.
+
+namespace {
+struct Position {
+    float x, y, z;
+};
+
+struct Velocity {
+    float x, y, z;
+};
+
+struct Health {
+    int value;
+};
+
+// Held by 1% of the entities
+struct Rare {
+    int value;
+};
+
+struct SparseRare {
+    static constexpr bool SparseStorage = true;
+
+    int value;
+};
+
+// Roughly the components of the nodes in media/ship.glb
+struct ShipTransform {
+    float position[3];
+    float orientation[4];
+    float scale[3];
+    float matrix[16];
+};
+
+struct ShipHierarchy {
+    ecs::EntityId parent, firstChild, prevSibling, nextSibling;
+};
+
+struct ShipName {
+    std::string value;
+};
+
+struct ShipMesh {
+    std::shared_ptr<int> mesh;
+};
+
+using Clock = std::chrono::steady_clock;
+
+const std::vector<size_t> entityCounts = { 1'000, 10'000, 100'000, 1'000'000 };
+
+// Sink for results, so the compiler can't throw away the iterations
+volatile float sink = 0.0f;
+
+size_t getRepetitions(size_t entityCount)
+{
+    return std::clamp<size_t>(1'000'000 / entityCount, 3, 50);
+}
+
+// setup is not measured, run is. Both get a fresh world for every repetition.
+double measure(size_t entityCount, const std::function<void(ecs::World&)>& setup,
+    const std::function<void(ecs::World&)>& run)
+{
+    auto best = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < getRepetitions(entityCount); ++i) {
+        ecs::World world;
+        setup(world);
+        const auto start = Clock::now();
+        run(world);
+        const auto duration = std::chrono::duration<double, std::nano>(Clock::now() - start);
+        best = std::min(best, duration.count());
+    }
+    return best / entityCount;
+}
+
+void createEntities(ecs::World& world, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        world.createEntity();
+    world.flush();
+}
+
+void createMoving(ecs::World& world, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        auto entity = world.createEntity();
+        entity.add<Position>(Position { static_cast<float>(i), 0.0f, 0.0f });
+        // Every other entity is moving, so the multi-component query only matches half
+        if (i % 2 == 0)
+            entity.add<Velocity>(Velocity { 1.0f, 0.0f, 0.0f });
+    }
+    world.flush();
+}
+
+template <typename RareType>
+double measureRare(size_t n)
+{
+    return measure(
+        n, [n](ecs::World& world) { createEntities(world, n); },
+        [n](ecs::World& world) {
+            for (size_t i = 0; i < n; i += 100)
+                world.addComponent<RareType>(static_cast<ecs::EntityId>(i), RareType { 1 });
+            auto sum = 0;
+            world.forEachEntity<const RareType>([&sum](const RareType& rare) { sum += rare.value; });
+            sink = static_cast<float>(sum);
+        });
+}
+
+std::vector<ecs::EntityId> getShuffledIds(size_t count)
+{
+    std::vector<ecs::EntityId> ids(count);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+    return ids;
+}
+
+// The ship has about this many nodes, which all become entities
+constexpr size_t shipEntityCount = 1126;
+
+// Microseconds for a save and a restore of a world like the instantiated ship, with the buffers of
+// the snapshot already allocated
+std::pair<double, double> measureShipSnapshot()
+{
+    ecs::World world;
+    const auto mesh = std::make_shared<int>(0);
+    for (size_t i = 0; i < shipEntityCount; ++i) {
+        auto entity = world.createEntity();
+        entity.add<ShipTransform>();
+        entity.add<ShipHierarchy>();
+        entity.add<ShipName>(ShipName { "node_" + std::to_string(i) });
+        if (i % 3 != 0)
+            entity.add<ShipMesh>(ShipMesh { mesh });
+    }
+    world.flush();
+
+    ecs::World::Snapshot snapshot;
+    world.saveSnapshot(snapshot);
+    auto bestSave = std::numeric_limits<double>::max();
+    auto bestRestore = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < 50; ++i) {
+        using Micros = std::chrono::duration<double, std::micro>;
+        const auto start = Clock::now();
+        world.saveSnapshot(snapshot);
+        const auto saved = Clock::now();
+        world.restoreSnapshot(snapshot);
+        const auto restored = Clock::now();
+        bestSave = std::min(bestSave, Micros(saved - start).count());
+        bestRestore = std::min(bestRestore, Micros(restored - saved).count());
+    }
+    return { bestSave, bestRestore };
+}
+
+struct Benchmark {
+    std::string name;
+    std::function<double(size_t)> run;
+};
+
+const std::vector<Benchmark> benchmarks = {
+    { "create",
+        [](size_t n) {
+            return measure(
+                n, [](ecs::World&) {}, [n](ecs::World& world) { createEntities(world, n); });
+        } },
+    { "destroy",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createEntities(world, n); },
+                [n](ecs::World& world) {
+                    for (size_t i = 0; i < n; ++i)
+                        world.destroyEntity(static_cast<ecs::EntityId>(i));
+                });
+        } },
+    { "clear",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n); },
+                [](ecs::World& world) { world.clear(); });
+        } },
+    // Destroys entities in random order and creates them again, so every id comes from the free
+    // list
+    { "recreate (free list)",
+        [](size_t n) {
+            const auto ids = getShuffledIds(n);
+            return measure(
+                n,
+                [n, &ids](ecs::World& world) {
+                    createEntities(world, n);
+                    for (const auto id : ids)
+                        world.destroyEntity(id);
+                },
+                [n](ecs::World& world) { createEntities(world, n); });
+        } },
+    { "add component",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createEntities(world, n); },
+                [n](ecs::World& world) {
+                    for (size_t i = 0; i < n; ++i)
+                        world.addComponent<Health>(static_cast<ecs::EntityId>(i), Health { 100 });
+                });
+        } },
+    { "create + add",
+        [](size_t n) {
+            return measure(
+                n, [](ecs::World&) {}, [n](ecs::World& world) { createMoving(world, n); });
+        } },
+    { "create + add (batch)",
+        [](size_t n) {
+            return measure(
+                n, [](ecs::World&) {},
+                [n](ecs::World& world) {
+                    // Same entities as createMoving, but one batch per archetype
+                    const auto moving = (n + 1) / 2;
+                    const auto first = world.createEntities<Position, Velocity>(moving);
+                    world.createEntities<Position>(n - moving);
+                    for (size_t i = 0; i < n; ++i) {
+                        const auto id = static_cast<ecs::EntityId>(first + i);
+                        world.getComponent<Position>(id).x = static_cast<float>(i);
+                        if (i < moving)
+                            world.getComponent<Velocity>(id).x = 1.0f;
+                    }
+                    world.flush();
+                });
+        } },
+    { "remove component",
+        [](size_t n) {
+            return measure(
+                n,
+                [n](ecs::World& world) {
+                    createEntities(world, n);
+                    for (size_t i = 0; i < n; ++i)
+                        world.addComponent<Health>(static_cast<ecs::EntityId>(i), Health { 100 });
+                },
+                [n](ecs::World& world) {
+                    for (size_t i = 0; i < n; ++i)
+                        world.removeComponent<Health>(static_cast<ecs::EntityId>(i));
+                });
+        } },
+    // The new entity is the first one in a block, so every add allocates a block and every
+    // destroy frees it
+    { "block boundary churn",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n / 64 * 64); },
+                [n](ecs::World& world) {
+                    for (size_t i = 0; i < n; ++i) {
+                        auto entity = world.createEntity();
+                        entity.add<Position>(Position { 0.0f, 0.0f, 0.0f });
+                        world.destroyEntity(entity.getId());
+                    }
+                });
+        } },
+    { "iterate 1 component",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n); },
+                [](ecs::World& world) {
+                    auto sum = 0.0f;
+                    world.forEachEntity<const Position>(
+                        [&sum](const Position& position) { sum += position.x; });
+                    sink = sum;
+                });
+        } },
+    { "iterate 2 components",
+        [](size_t n) {
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n); },
+                [](ecs::World& world) {
+                    world.forEachEntity<Position, const Velocity>(
+                        [](Position& position, const Velocity& velocity) {
+                            position.x += velocity.x;
+                            position.y += velocity.y;
+                            position.z += velocity.z;
+                        });
+                });
+        } },
+    { "random getComponent",
+        [](size_t n) {
+            const auto ids = getShuffledIds(n);
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n); },
+                [&ids](ecs::World& world) {
+                    auto sum = 0.0f;
+                    for (const auto id : ids)
+                        sum += world.getComponent<const Position>(id).x;
+                    sink = sum;
+                });
+        } },
+    { "snapshot save + restore",
+        [](size_t n) {
+            ecs::World::Snapshot snapshot;
+            return measure(
+                n, [n](ecs::World& world) { createMoving(world, n); },
+                [&snapshot](ecs::World& world) {
+                    world.saveSnapshot(snapshot);
+                    world.restoreSnapshot(snapshot);
+                });
+        } },
+    // Adds the component to 1% of the entities and iterates them
+    { "rare component", measureRare<Rare> },
+    { "rare component (sparse)", measureRare<SparseRare> },
+};
+}
+
+int main()
+{
+    fmt::print("{:<24}", "ns/entity");
+    for (const auto count : entityCounts)
+        fmt::print("{:>12}", count);
+    fmt::print("\n");
+    for (const auto& benchmark : benchmarks) {
+        fmt::print("{:<24}", benchmark.name);
+        std::fflush(stdout);
+        for (const auto count : entityCounts) {
+            fmt::print("{:>12.2f}", benchmark.run(count));
+            std::fflush(stdout);
+        }
+        fmt::print("\n");
+    }
+
+    const auto [save, restore] = measureShipSnapshot();
+    fmt::print("\nship snapshot ({} entities): save {:.1f} us, restore {:.1f} us\n",
+        shipEntityCount, save, restore);
+    return 0;
+}
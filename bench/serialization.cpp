@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "net.hpp"
+
+// Prints the size of every message type and how long it takes to serialize it into a packet
+// buffer and to decode it again (like Client/Server::receive). Every
+// measurement is the minimum of a number of repetitions, like in bench/ecs.cpp.
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t messageCount = 100'000;
+constexpr size_t repetitions = 10;
+
+// Sink for results, so the compiler can't throw away the iterations
+volatile size_t sink = 0;
+
+const std::string terminalOutput(2000, 'x');
+const std::vector<std::string_view> terminalHistory(20, "engine.setThrottle(0.5)");
+
+// Representative contents for every message type. Strings are on the long side of what the game
+// sends.
+template <MessageType MsgType>
+Message<MsgType> makeMessage();
+
+template <>
+Message<MessageType::ServerHello> makeMessage()
+{
+    return { 3, glm::vec3(1.0f, 2.0f, 3.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f) };
+}
+
+template <>
+Message<MessageType::ClientMoveUpdate> makeMessage()
+{
+    return { glm::vec3(1.0f, 2.0f, 3.0f), glm::normalize(glm::quat(0.9f, 0.1f, 0.3f, 0.0f)), 24 };
+}
+
+// A full update with all players
+template <>
+Message<MessageType::ServerPlayerStateUpdate> makeMessage()
+{
+    Message<MessageType::ServerPlayerStateUpdate> message;
+    for (uint32_t i = 0; i < maxPlayers; ++i)
+        message.players.push_back({ i, glm::vec3(static_cast<float>(i), 2.0f, -3.0f),
+            glm::normalize(glm::quat(0.9f, 0.1f, 0.3f, 0.0f)) });
+    return message;
+}
+
+template <>
+Message<MessageType::ClientInteractTerminal> makeMessage()
+{
+    return { "reactor" };
+}
+
+template <>
+Message<MessageType::ServerInteractTerminal> makeMessage()
+{
+    return { "reactor", 3 };
+}
+
+template <>
+Message<MessageType::ClientUpdateTerminalInput> makeMessage()
+{
+    return { "reactor.setPower(0.8" };
+}
+
+template <>
+Message<MessageType::ClientExecuteCommand> makeMessage()
+{
+    return { "reactor.setPower(0.8)" };
+}
+
+template <>
+Message<MessageType::ServerUpdateTerminalOutput> makeMessage()
+{
+    return { "reactor", terminalOutput };
+}
+
+template <>
+Message<MessageType::ServerAddTerminalHistory> makeMessage()
+{
+    return { "engine", terminalHistory };
+}
+
+template <>
+Message<MessageType::ClientPlaySound> makeMessage()
+{
+    return { "terminal_beep", glm::vec3(1.0f, 2.0f, 3.0f) };
+}
+
+template <>
+Message<MessageType::ServerUpdateInputEnabled> makeMessage()
+{
+    return { "engine", true };
+}
+
+template <>
+Message<MessageType::ServerUpdateShipState> makeMessage()
+{
+    return { 0.5f, 0.75f };
+}
+
+template <typename Func>
+double measure(Func&& func)
+{
+    auto best = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < repetitions; ++i) {
+        const auto start = Clock::now();
+        func();
+        const auto duration = std::chrono::duration<double, std::nano>(Clock::now() - start);
+        best = std::min(best, duration.count());
+    }
+    return best / messageCount;
+}
+
+double megabytesPerSecond(size_t bytes, double nanoseconds)
+{
+    return bytes / nanoseconds * 1e9 / (1024.0 * 1024.0);
+}
+
+template <MessageType MsgType>
+void benchmark()
+{
+    const auto message = makeMessage<MsgType>();
+
+    const auto encodeNs = measure([&message]() {
+        for (size_t i = 0; i < messageCount; ++i) {
+            auto buffer = serializeMessage(static_cast<uint32_t>(i), message);
+            sink = sink + buffer->getSize();
+            // Like the packet's free callback, so the pool is warm
+            PacketBufferPool::instance().release(std::move(buffer));
+        }
+    });
+
+    const auto packet = serializeMessage(0, message);
+    const auto decodeNs = measure([&packet]() {
+        for (size_t i = 0; i < messageCount; ++i) {
+            const auto valid = forEachMessage(packet->getData(), packet->getSize(),
+                [](uint32_t, MessageType, ReadBuffer& buffer) {
+                    Message<MsgType> decoded;
+                    if (!deserialize<BitReadStream>(buffer, decoded))
+                        std::abort();
+                    sink = sink + buffer.getCursor();
+                });
+            if (!valid)
+                std::abort();
+        }
+    });
+
+    const auto size = packet->getSize();
+    fmt::print("{:<28}{:>8}{:>12.1f}{:>12.1f}{:>12.1f}{:>12.1f}\n", asString(MsgType), size,
+        encodeNs, decodeNs, megabytesPerSecond(size, encodeNs),
+        megabytesPerSecond(size, decodeNs));
+    std::fflush(stdout);
+}
+
+template <size_t... Indices>
+void benchmarkAll(std::index_sequence<Indices...>)
+{
+    (benchmark<static_cast<MessageType>(Indices)>(), ...);
+}
+}
+
+int main()
+{
+    fmt::print("{:<28}{:>8}{:>12}{:>12}{:>12}{:>12}\n", "message", "bytes", "enc ns", "dec ns",
+        "enc MB/s", "dec MB/s");
+    benchmarkAll(std::make_index_sequence<MessageTypeCount>());
+    return 0;
+}
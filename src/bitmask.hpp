@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BITMASK_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define BITMASK_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit. word must not be 0.
+inline size_t countTrailingZeros(uint64_t word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index;
+#else
+    return static_cast<size_t>(__builtin_ctzll(word));
+#endif
+}
+
+// A fixed size set of bits like std::bitset, but it exposes its words, so includes() can compare
+// 128 or 256 bits at once with SSE2/AVX2.
+template <size_t Bits>
+struct BitMask {
+    static_assert(Bits > 0 && Bits % 64 == 0, "BitMask size must be a multiple of 64");
+    static constexpr size_t WordCount = Bits / 64;
+
+    alignas(Bits >= 256 ? 32 : 16) std::array<uint64_t, WordCount> words {};
+
+    static BitMask all()
+    {
+        BitMask mask;
+        mask.words.fill(~uint64_t(0));
+        return mask;
+    }
+
+    bool test(size_t bit) const
+    {
+        return (words[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+    }
+
+    BitMask& set(size_t bit)
+    {
+        words[bit / 64] |= uint64_t(1) << (bit % 64);
+        return *this;
+    }
+
+    BitMask& reset(size_t bit)
+    {
+        words[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+        return *this;
+    }
+
+    bool any() const
+    {
+        for (const auto word : words) {
+            if (word)
+                return true;
+        }
+        return false;
+    }
+
+    bool none() const
+    {
+        return !any();
+    }
+
+    // Calls func(size_t bit) for every set bit in ascending order
+    template <typename FuncType>
+    void forEachSetBit(FuncType func) const
+    {
+        for (size_t i = 0; i < WordCount; ++i) {
+            auto word = words[i];
+            while (word) {
+                func(i * 64 + countTrailingZeros(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    // (*this & other) == other
+    bool includes(const BitMask& other) const
+    {
+        size_t word = 0;
+#ifdef BITMASK_AVX2
+        for (; word + 4 <= WordCount; word += 4) {
+            const auto a = _mm256_load_si256(reinterpret_cast<const __m256i*>(&words[word]));
+            const auto b = _mm256_load_si256(reinterpret_cast<const __m256i*>(&other.words[word]));
+            // andnot computes ~a & b, which are the bits in other that are missing in this
+            if (!_mm256_testz_si256(_mm256_andnot_si256(a, b), _mm256_set1_epi8(-1)))
+                return false;
+        }
+#endif
+#ifdef BITMASK_SSE2
+        for (; word + 2 <= WordCount; word += 2) {
+            const auto a = _mm_load_si128(reinterpret_cast<const __m128i*>(&words[word]));
+            const auto b = _mm_load_si128(reinterpret_cast<const __m128i*>(&other.words[word]));
+            const auto missing = _mm_andnot_si128(a, b);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(missing, _mm_setzero_si128())) != 0xFFFF)
+                return false;
+        }
+#endif
+        for (; word < WordCount; ++word) {
+            if ((words[word] & other.words[word]) != other.words[word])
+                return false;
+        }
+        return true;
+    }
+
+    bool intersects(const BitMask& other) const
+    {
+        for (size_t i = 0; i < WordCount; ++i) {
+            if (words[i] & other.words[i])
+                return true;
+        }
+        return false;
+    }
+
+    BitMask& operator|=(const BitMask& other)
+    {
+        for (size_t i = 0; i < WordCount; ++i)
+            words[i] |= other.words[i];
+        return *this;
+    }
+
+    BitMask& operator&=(const BitMask& other)
+    {
+        for (size_t i = 0; i < WordCount; ++i)
+            words[i] &= other.words[i];
+        return *this;
+    }
+
+    BitMask operator|(const BitMask& other) const
+    {
+        return BitMask(*this) |= other;
+    }
+
+    BitMask operator&(const BitMask& other) const
+    {
+        return BitMask(*this) &= other;
+    }
+
+    BitMask operator~() const
+    {
+        BitMask mask;
+        for (size_t i = 0; i < WordCount; ++i)
+            mask.words[i] = ~words[i];
+        return mask;
+    }
+
+    bool operator==(const BitMask& other) const
+    {
+        return words == other.words;
+    }
+
+    bool operator!=(const BitMask& other) const
+    {
+        return words != other.words;
+    }
+};
+
+namespace std {
+template <size_t Bits>
+struct hash<BitMask<Bits>> {
+    size_t operator()(const BitMask<Bits>& mask) const
+    {
+        // boost::hash_combine
+        size_t seed = 0;
+        for (const auto word : mask.words)
+            seed ^= std::hash<uint64_t>()(word) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        return seed;
+    }
+};
+}
@@ -12,6 +12,7 @@
 #include <shellapi.h>
 #endif
 
+#include "commandbuffer.hpp"
 #include "constants.hpp"
 #include "gltfimport.hpp"
 #include "graphics.hpp"
@@ -269,6 +270,7 @@ bool Client::run(std::optional<HostPort> hostPort, uint32_t gameCode)
         SDL_SCANCODE_D, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_LSHIFT, MouseButtonInput(1));
 
     world_.flush();
+    transformVersion_ = transformSystem(world_, transformVersion_);
 
     // We load everything else before attempting to connect, because we don't want a connection
     // to time out or something.
@@ -303,6 +305,7 @@ bool Client::run(std::optional<HostPort> hostPort, uint32_t gameCode)
     const auto event = host_.service(5000);
     if (event && std::holds_alternative<enet::ConnectEvent>(*event)) {
         println("Connected.");
+        outgoing_ = MessageQueue(serverPeer_);
     } else {
         showError("Connection failed.");
         enet_peer_reset(serverPeer_);
@@ -358,6 +361,7 @@ bool Client::run(std::optional<HostPort> hostPort, uint32_t gameCode)
             processEnetEvents();
             update(dt);
             sendUpdate();
+            outgoing_.flush();
             accumulator -= dt;
             time_ += dt;
             frameCounter_++;
@@ -496,7 +500,21 @@ void Client::processSdlEvents()
                     debugFrustumCulling = !debugFrustumCulling;
                 break;
             case SDL_SCANCODE_P:
-                println("pos: {}", player_.get<comp::Transform>().getPosition());
+                println("pos: {}", player_.get<const comp::Transform>().getPosition());
+                break;
+            case SDL_SCANCODE_M:
+                if (event.key.keysym.mod & KMOD_CTRL) {
+                    const auto stats = world_.getMemoryStats();
+                    for (const auto& comp : stats.components)
+                        println("{} ({}): {} components, {} KiB, {} blocks, {:.0f}% occupied, "
+                                "{:.0f}% fragmented",
+                            comp.typeName, comp.componentId, comp.componentCount,
+                            comp.bytes / 1024, comp.blockCount, comp.occupancy * 100.0f,
+                            comp.fragmentation * 100.0f);
+                    println("entities: {} KiB, retained blocks: {} KiB, total: {} KiB",
+                        stats.entityBytes / 1024, stats.retainedBlockBytes / 1024,
+                        stats.totalBytes / 1024);
+                }
                 break;
             case SDL_SCANCODE_1:
                 // Nav
@@ -545,12 +563,14 @@ void Client::processEnetEvents()
 
 void Client::handleInteractions()
 {
+    ecs::CommandBuffer commands;
     world_.forEachEntity<const comp::RenderHighlight>(
-        [](ecs::EntityHandle entity, const comp::RenderHighlight&) {
-            entity.remove<comp::RenderHighlight>();
+        [&commands](ecs::EntityHandle entity, const comp::RenderHighlight&) {
+            commands.removeComponent<comp::RenderHighlight>(entity);
         });
+    commands.apply(world_);
 
-    auto& trafo = player_.get<comp::Transform>();
+    const auto& trafo = player_.get<const comp::Transform>();
     const auto rayOrigin = trafo.getPosition() + glm::vec3(0.0f, cameraOffsetY, 0.0f);
     const auto rayDir = trafo.getForward();
     auto hit = castRay(world_, rayOrigin, rayDir);
@@ -611,7 +631,10 @@ void Client::handleInteractions()
 SoLoud::handle Client::playEntitySound(
     const std::string& name, ecs::EntityHandle entity, float volume, float playbackSpeed)
 {
-    return play3dSound(name, entity.get<comp::Transform>().getPosition(), volume, playbackSpeed);
+    const auto worldTransform = entity.getPtr<const comp::WorldTransform>();
+    const auto position = worldTransform ? worldTransform->getPosition()
+                                         : entity.get<const comp::Transform>().getPosition();
+    return play3dSound(name, position, volume, playbackSpeed);
 }
 
 SoLoud::handle Client::playEntitySound(
@@ -638,7 +661,7 @@ void Client::update(float dt)
         integrationSystem(world_, dt);
         handleInteractions();
 
-        const auto& trafo = player_.get<comp::Transform>();
+        const auto& trafo = player_.get<const comp::Transform>();
         auto& velocity = player_.get<comp::Velocity>().value;
         if (glm::length(velocity) > 0.1f) {
             if (nextStepSound_ < time_) {
@@ -651,10 +674,11 @@ void Client::update(float dt)
 
         // Negative velocity, because otherwise the doppler effect will be the wrong way around
         // :)
-        updateListener(player_.get<comp::Transform>(), -player_.get<comp::Velocity>().value);
+        updateListener(
+            player_.get<const comp::Transform>(), -player_.get<const comp::Velocity>().value);
     } else if (const auto terminal = std::get_if<TerminalState>(&state_)) {
         auto& trafo = player_.get<comp::Transform>();
-        const auto& termTrafo = terminal->terminalEntity.get<comp::Transform>();
+        const auto& termTrafo = terminal->terminalEntity.get<const comp::Transform>();
         const auto targetDist = 2.5f;
         auto targetPos = termTrafo.getPosition() - termTrafo.getForward() * targetDist;
         targetPos.y = trafo.getPosition().y;
@@ -683,12 +707,14 @@ void Client::update(float dt)
             stopTerminalInteraction();
         }
 
+        ecs::CommandBuffer commands;
         world_.forEachEntity<const comp::RenderHighlight>(
-            [](ecs::EntityHandle entity, const comp::RenderHighlight&) {
-                entity.remove<comp::RenderHighlight>();
+            [&commands](ecs::EntityHandle entity, const comp::RenderHighlight&) {
+                commands.removeComponent<comp::RenderHighlight>(entity);
             });
+        commands.apply(world_);
 
-        updateListener(player_.get<comp::Transform>(), glm::vec3(0.0f));
+        updateListener(player_.get<const comp::Transform>(), glm::vec3(0.0f));
     }
 
     world_.forEachEntity<const comp::Terminal, const comp::Transform>(
@@ -697,55 +723,50 @@ void Client::update(float dt)
                 play3dSound("terminalIdleBeep", transform.getPosition());
         });
 
-    world_.forEachEntity<const comp::Transform, const comp::Mesh, const comp::Name>(
-        [this](const comp::Transform& transform, const comp::Mesh&, const comp::Name& name) {
+    world_.forEachEntity<const comp::WorldTransform, const comp::Mesh, const comp::Name>(
+        [this](const comp::WorldTransform& transform, const comp::Mesh&, const comp::Name& name) {
             if (name.value.find("reactorcell") == 0 && rand<float>() < 0.01f)
                 play3dSound("reactorZap", transform.getPosition());
         });
 
-    world_.forEachEntity<comp::Transform, const comp::Rotate>(
+    world_.parallelForEach<comp::Transform, const comp::Rotate>(
         [dt](comp::Transform& transform, const comp::Rotate& rotate) {
             transform.rotate(
                 glm::angleAxis(2.0f * glm::pi<float>() * rotate.frequency * dt, rotate.axis));
         });
+
+    transformVersion_ = transformSystem(world_, transformVersion_);
 }
 
 void Client::sendUpdate()
 {
-    const auto& trafo = player_.get<comp::Transform>();
+    const auto& trafo = player_.get<const comp::Transform>();
     send(Channel::Unreliable,
-        Message<MessageType::ClientMoveUpdate> { trafo.getPosition(), trafo.getOrientation() });
+        Message<MessageType::ClientMoveUpdate> {
+            clampNetPosition(trafo.getPosition(), outsideNetBounds_), trafo.getOrientation(),
+            playerStates_.getAckedSlot() });
 }
 
-#define MESSAGE_CASE(Type)                                                                         \
-    case MessageType::Type:                                                                        \
-        processMessage<MessageType::Type>(header.frameNumber, buffer);                             \
-        break;
-
 void Client::receive(uint8_t channelId, const enet::Packet& packet)
 {
-    ReadBuffer buffer(packet.getData<uint8_t>(), packet.getSize());
-    CommonMessageHeader header;
-    if (!deserialize(buffer, header)) {
-        printErr("Could not decode common message header");
-        return; // Ignore message
-    }
-    const auto messageType = static_cast<MessageType>(header.messageType);
-    if (static_cast<Channel>(channelId) == Channel::Reliable) {
-        // println("[client] Received message: {}", asString(messageType));
-    }
-    switch (messageType) {
-        MESSAGE_CASE(ServerHello);
-        MESSAGE_CASE(ServerPlayerStateUpdate);
-        MESSAGE_CASE(ServerInteractTerminal);
-        MESSAGE_CASE(ServerUpdateTerminalOutput);
-        MESSAGE_CASE(ServerAddTerminalHistory);
-        MESSAGE_CASE(ClientPlaySound);
-        MESSAGE_CASE(ServerUpdateInputEnabled);
-        MESSAGE_CASE(ServerUpdateShipState);
-    default:
-        printErr("Received unrecognized message: {}", asString(messageType));
-    }
+    static constexpr auto handlers = makeMessageHandlers<MessageType::ServerHello,
+        MessageType::ServerPlayerStateUpdate, MessageType::ServerInteractTerminal,
+        MessageType::ServerUpdateTerminalOutput, MessageType::ServerAddTerminalHistory,
+        MessageType::ClientPlaySound, MessageType::ServerUpdateInputEnabled,
+        MessageType::ServerUpdateShipState>();
+
+    const auto valid = forEachMessage(packet.getData<uint8_t>(), packet.getSize(),
+        [this, channelId](uint32_t frameNumber, MessageType messageType, ReadBuffer& buffer) {
+            if (static_cast<Channel>(channelId) == Channel::Reliable) {
+                // println("[client] Received message: {}", asString(messageType));
+            }
+            const auto handler
+                = findMessageHandler(handlers, messageType, channelId, buffer.getLeft());
+            if (handler)
+                (this->*handler)(frameNumber, buffer);
+        });
+    if (!valid)
+        printErr("Could not decode packet"); // Ignore the rest
 }
 
 void Client::processMessage(
@@ -772,11 +793,12 @@ void Client::addPlayer(PlayerId id)
 void Client::processMessage(
     uint32_t frameNumber, const Message<MessageType::ServerPlayerStateUpdate>& message)
 {
-    static uint32_t lastUpdateFrame = 0;
-    if (frameNumber < lastUpdateFrame)
+    const auto states = playerStates_.receive(frameNumber, message);
+    if (!states)
         return;
+    const auto& playerStates = *states;
 
-    for (const auto& player : message.players) {
+    for (const auto& player : playerStates) {
         if (player.id == playerId_)
             continue;
         auto it = players_.find(player.id);
@@ -794,7 +816,7 @@ void Client::processMessage(
     std::vector<PlayerId> playersToRemove;
     for (const auto& [id, entity] : players_) {
         bool found = false;
-        for (const auto& msgPlayer : message.players) {
+        for (const auto& msgPlayer : playerStates) {
             if (msgPlayer.id == id) {
                 found = true;
                 break;
@@ -814,7 +836,6 @@ void Client::processMessage(
 
     world_.flush();
 
-    lastUpdateFrame = frameNumber;
 }
 
 ecs::EntityHandle Client::findTerminal(const std::string& system)
@@ -833,9 +854,10 @@ ecs::EntityHandle Client::findTerminal(const std::string& system)
 void Client::processMessage(
     uint32_t /*frameNumber*/, const Message<MessageType::ServerInteractTerminal>& message)
 {
-    terminalData_[message.terminal].currentUser = message.user;
+    const auto terminal = std::string(message.terminal);
+    terminalData_[terminal].currentUser = message.user;
     if (message.user == playerId_) {
-        state_ = TerminalState { findTerminal(message.terminal), message.terminal };
+        state_ = TerminalState { findTerminal(terminal), terminal };
         send(Channel::Reliable, Message<MessageType::ClientUpdateTerminalInput> { "" });
     }
 }
@@ -843,7 +865,7 @@ void Client::processMessage(
 void Client::processMessage(
     uint32_t /*frameNumber*/, const Message<MessageType::ServerUpdateTerminalOutput>& message)
 {
-    auto& termData = terminalData_[message.terminal];
+    auto& termData = terminalData_[std::string(message.terminal)];
     termData.output.append(message.text);
     termData.scroll = HUGE_VALF; // scroll to end
     if (const auto terminalState = std::get_if<TerminalState>(&state_)) {
@@ -855,9 +877,9 @@ void Client::processMessage(
 void Client::processMessage(
     uint32_t /*frameNumber*/, const Message<MessageType::ServerAddTerminalHistory>& message)
 {
-    auto& termData = terminalData_[message.terminal];
+    auto& termData = terminalData_[std::string(message.terminal)];
     for (const auto& command : message.commands) {
-        termData.history.push_front(command);
+        termData.history.emplace_front(command);
     }
     while (termData.history.size() > maxHistoryEntries) {
         termData.history.pop_back();
@@ -867,13 +889,13 @@ void Client::processMessage(
 void Client::processMessage(
     uint32_t /*frameNumber*/, const Message<MessageType::ClientPlaySound>& message)
 {
-    play3dSound(message.name, message.position);
+    play3dSound(std::string(message.name), message.position);
 }
 
 void Client::processMessage(
     uint32_t /*frameNumber*/, const Message<MessageType::ServerUpdateInputEnabled>& message)
 {
-    auto& termData = terminalData_[message.terminal];
+    auto& termData = terminalData_[std::string(message.terminal)];
     if (const auto ts = std::get_if<TerminalState>(&state_)) {
         if (ts->systemName == message.terminal && !termData.inputEnabled && message.enabled) {
             playEntitySound("terminalExecuteDone", ts->terminalEntity);
@@ -894,7 +916,7 @@ void Client::draw()
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    auto cameraTransform = player_.get<comp::Transform>();
+    auto cameraTransform = player_.get<const comp::Transform>();
     cameraTransform.move(glm::vec3(0.0f, cameraOffsetY, 0.0f));
     glw::State::instance().resetStatistics();
     resetRenderStats();
@@ -909,7 +931,7 @@ void Client::draw()
         }
 
         renderTerminalScreens(
-            world_, player_.get<comp::Transform>().getPosition(), terminalData_, terminal);
+            world_, player_.get<const comp::Transform>().getPosition(), terminalData_, terminal);
         renderSystem(world_, frustum_, cameraTransform, shipState_);
         skybox_->draw(frustum_, cameraTransform);
     }
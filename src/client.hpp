@@ -49,20 +49,30 @@ private:
     template <MessageType MsgType>
     bool send(Channel channel, const Message<MsgType>& message)
     {
-        return sendMessage(serverPeer_, channel, frameCounter_, message);
+        return outgoing_.add(channel, frameCounter_, message);
     }
 
     template <MessageType MsgType>
     void processMessage(uint32_t frameNumber, ReadBuffer& buffer)
     {
         Message<MsgType> message;
-        if (!deserialize(buffer, message)) {
-            printErr("Could not decode message of type {}", static_cast<uint8_t>(MsgType));
+        if (!deserialize<BitReadStream>(buffer, message)) {
+            printErr("Could not decode message of type {}", asString(MsgType));
             return;
         }
         processMessage(frameNumber, message);
     }
 
+    using MessageHandler = void (Client::*)(uint32_t, ReadBuffer&);
+
+    template <MessageType... MsgTypes>
+    static constexpr MessageHandlerTable<MessageHandler> makeMessageHandlers()
+    {
+        MessageHandlerTable<MessageHandler> handlers {};
+        ((handlers[static_cast<size_t>(MsgTypes)] = &Client::processMessage<MsgTypes>), ...);
+        return handlers;
+    }
+
     void stopTerminalInteraction();
     void scrollTerminal(float amount);
     void terminalHistory(int offset);
@@ -91,14 +101,18 @@ private:
     void playNetSound(const std::string& name, const glm::vec3& position);
 
     ENetPeer* serverPeer_ = nullptr;
+    MessageQueue outgoing_;
     enet::Host host_;
     glwx::Window window_;
     ecs::World world_;
+    ecs::Version transformVersion_ = 0;
     Frustum frustum_;
     PlayerState state_;
     ShipState shipState_;
     float nextStepSound_ = 0.0f;
     std::unordered_map<PlayerId, ecs::EntityHandle> players_; // excludes self
+    PlayerStateReceiver playerStates_;
+    bool outsideNetBounds_ = false;
     std::unordered_map<ShipSystem::Name, TerminalData> terminalData_;
     std::vector<std::shared_ptr<Mesh>> playerMeshes_;
     std::unique_ptr<Skybox> skybox_;
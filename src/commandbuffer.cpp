@@ -0,0 +1,96 @@
+#include "commandbuffer.hpp"
+
+#include <unordered_map>
+
+namespace ecs {
+
+CommandBuffer::Entity::Entity(EntityId id)
+    : id_(id)
+{
+}
+
+CommandBuffer::Entity::Entity(const EntityHandle& entity)
+    : id_(entity.getId())
+{
+}
+
+CommandBuffer::Entity::Entity(size_t createdIndex, bool created)
+    : createdIndex_(createdIndex)
+    , created_(created)
+{
+}
+
+CommandBuffer::Entity CommandBuffer::createEntity()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Entity(createCount_++, true);
+}
+
+void CommandBuffer::destroyEntity(const Entity& entity)
+{
+    record(Command { CommandType::Destroy, entity });
+}
+
+bool CommandBuffer::isEmpty() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return createCount_ == 0 && commands_.empty();
+}
+
+void CommandBuffer::apply(World& world)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<EntityId> created;
+    created.reserve(createCount_);
+    for (size_t i = 0; i < createCount_; ++i)
+        created.push_back(world.createEntity().getId());
+
+    std::unordered_map<size_t, std::pair<ComponentPoolBase*, std::vector<EntityId>>> additions;
+    for (const auto& command : commands_) {
+        if (command.type == CommandType::AddComponent) {
+            auto& [pool, entities] = additions[command.component->getComponentId()];
+            if (!pool)
+                pool = &command.component->getPool(world);
+            entities.push_back(resolve(command.entity, created));
+        }
+    }
+    for (auto& [componentId, addition] : additions)
+        addition.first->reserve(addition.second);
+
+    for (auto& command : commands_) {
+        const auto entityId = resolve(command.entity, created);
+        switch (command.type) {
+        case CommandType::Destroy:
+            world.destroyEntity(entityId);
+            break;
+        case CommandType::AddComponent:
+        case CommandType::RemoveComponent:
+            command.component->apply(world, entityId);
+            break;
+        }
+    }
+
+    for (const auto entityId : created)
+        world.flush(entityId);
+
+    commands_.clear();
+    createCount_ = 0;
+}
+
+void CommandBuffer::record(Command&& command)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    commands_.push_back(std::move(command));
+}
+
+EntityId CommandBuffer::resolve(const Entity& entity, const std::vector<EntityId>& created) const
+{
+    if (entity.created_) {
+        assert(entity.createdIndex_ < created.size());
+        return created[entity.createdIndex_];
+    }
+    return entity.id_;
+}
+
+}
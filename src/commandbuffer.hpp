@@ -0,0 +1,135 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ecs.hpp"
+
+namespace ecs {
+
+// Records structural changes (creating and destroying entities, adding and removing components),
+// so they can be made while iterating or from parallel jobs. They are executed in the order they
+// were recorded when apply is called. Recording is thread-safe.
+class CommandBuffer {
+public:
+    // Either an existing entity or one created by this command buffer
+    class Entity {
+    public:
+        Entity(EntityId id);
+        Entity(const EntityHandle& entity);
+
+    private:
+        friend class CommandBuffer;
+
+        Entity(size_t createdIndex, bool created);
+
+        EntityId id_ = InvalidEntity;
+        size_t createdIndex_ = 0;
+        bool created_ = false;
+    };
+
+    CommandBuffer() = default;
+    CommandBuffer(const CommandBuffer&) = delete;
+    CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+    Entity createEntity();
+
+    void destroyEntity(const Entity& entity);
+
+    template <typename ComponentType, typename... Args>
+    void addComponent(const Entity& entity, Args&&... args);
+
+    template <typename ComponentType>
+    void removeComponent(const Entity& entity);
+
+    bool isEmpty() const;
+
+    // Entities created by the command buffer are flushed after all commands have been executed.
+    // Storage for all added components is reserved before, so that every pool allocates at most
+    // once per block.
+    void apply(World& world);
+
+private:
+    struct ComponentCommand {
+        virtual ~ComponentCommand() = default;
+        virtual void apply(World& world, EntityId entityId) = 0;
+        virtual size_t getComponentId() const = 0;
+        virtual ComponentPoolBase& getPool(World& world) const = 0;
+    };
+
+    template <typename ComponentType>
+    struct AddComponent : public ComponentCommand {
+        ComponentType component;
+
+        template <typename... Args>
+        AddComponent(Args&&... args)
+            : component(std::forward<Args>(args)...)
+        {
+        }
+
+        void apply(World& world, EntityId entityId) override
+        {
+            world.addComponent<ComponentType>(entityId, std::move(component));
+        }
+
+        size_t getComponentId() const override
+        {
+            return componentId::get<ComponentType>();
+        }
+
+        ComponentPoolBase& getPool(World& world) const override
+        {
+            return world.getPool<ComponentType>();
+        }
+    };
+
+    template <typename ComponentType>
+    struct RemoveComponent : public ComponentCommand {
+        void apply(World& world, EntityId entityId) override
+        {
+            world.removeComponent<ComponentType>(entityId);
+        }
+
+        size_t getComponentId() const override
+        {
+            return componentId::get<ComponentType>();
+        }
+
+        ComponentPoolBase& getPool(World& world) const override
+        {
+            return world.getPool<ComponentType>();
+        }
+    };
+
+    enum class CommandType { Destroy, AddComponent, RemoveComponent };
+
+    struct Command {
+        CommandType type;
+        Entity entity;
+        std::unique_ptr<ComponentCommand> component = nullptr;
+    };
+
+    void record(Command&& command);
+    EntityId resolve(const Entity& entity, const std::vector<EntityId>& created) const;
+
+    mutable std::mutex mutex_;
+    size_t createCount_ = 0;
+    std::vector<Command> commands_;
+};
+
+template <typename ComponentType, typename... Args>
+void CommandBuffer::addComponent(const Entity& entity, Args&&... args)
+{
+    record(Command { CommandType::AddComponent, entity,
+        std::make_unique<AddComponent<ComponentType>>(std::forward<Args>(args)...) });
+}
+
+template <typename ComponentType>
+void CommandBuffer::removeComponent(const Entity& entity)
+{
+    record(Command {
+        CommandType::RemoveComponent, entity, std::make_unique<RemoveComponent<ComponentType>>() });
+}
+
+}
@@ -9,17 +9,104 @@ size_t componentId::getNextId()
     return idCounter++;
 }
 
+void EntityIdFreeList::push(EntityId entityId)
+{
+    const auto word = entityId / 64;
+    if (word >= words_.size())
+        words_.resize(word + 1, 0);
+    const auto bit = uint64_t(1) << (entityId % 64);
+    assert(!(words_[word] & bit)); // destroyed twice
+    words_[word] |= bit;
+    firstWord_ = std::min(firstWord_, static_cast<size_t>(word));
+    size_++;
+}
+
+EntityId EntityIdFreeList::pop()
+{
+    assert(size_ > 0);
+    while (!words_[firstWord_])
+        firstWord_++;
+    auto& word = words_[firstWord_];
+    const auto entityId = static_cast<EntityId>(firstWord_ * 64 + countTrailingZeros(word));
+    word &= word - 1;
+    size_--;
+    return entityId;
+}
+
+void EntityIdFreeList::clear()
+{
+    words_.clear();
+    firstWord_ = 0;
+    size_ = 0;
+}
+
+BlockAllocator::~BlockAllocator()
+{
+    release(0);
+}
+
+void* BlockAllocator::allocate(size_t size)
+{
+    auto& freeList = freeLists_[size];
+    if (freeList.empty())
+        return operator new(size);
+    const auto ptr = freeList.back();
+    freeList.pop_back();
+    retainedBytes_ -= size;
+    return ptr;
+}
+
+void BlockAllocator::free(void* ptr, size_t size)
+{
+    if (retainedBytes_ + size > maxRetainedBytes_) {
+        operator delete(ptr);
+        return;
+    }
+    freeLists_[size].push_back(ptr);
+    retainedBytes_ += size;
+}
+
+void BlockAllocator::setMaxRetainedBytes(size_t maxBytes)
+{
+    maxRetainedBytes_ = maxBytes;
+    release(maxBytes);
+}
+
+void BlockAllocator::release(size_t maxBytes)
+{
+    for (auto& [size, freeList] : freeLists_) {
+        while (retainedBytes_ > maxBytes && !freeList.empty()) {
+            operator delete(freeList.back());
+            freeList.pop_back();
+            retainedBytes_ -= size;
+        }
+    }
+}
+
 World::EntityIterator& World::EntityIterator::operator++()
 {
-    entityIndex_++;
     const auto& world = list_->world;
-    while (entityIndex_ < world.getEntityCount()
-        && (!world.isValid(entityIndex_) || !world.hasComponents(entityIndex_, list_->mask)))
-        entityIndex_++;
-    if (entityIndex_ >= world.getEntityCount()) {
-        entityIndex_ = MaxIndex;
+    const auto& archetypes = list_->query.archetypes;
+    // Entities stay in their archetypes during iteration (see World::beginIteration), but the
+    // components they have are changed immediately.
+    while (true) {
+        if (row_ > 0)
+            row_--;
+        while (row_ == 0) {
+            queryArchetype_++;
+            if (queryArchetype_ >= archetypes.size()) {
+                queryArchetype_ = MaxIndex;
+                return *this;
+            }
+            row_ = world.archetypes_[archetypes[queryArchetype_]].entities.size();
+        }
+        // Without pending moves, all entities in the archetype match
+        const auto entityId = world.archetypes_[archetypes[queryArchetype_]].entities[row_ - 1];
+        if (world.isValid(entityId)
+            && (world.deferredArchetypeUpdates_.empty()
+                || world.componentMasks_[entityId].includes(list_->query.mask)))
+            return *this;
     }
-    return *this;
 }
 
 World::EntityIterator World::EntityIterator::operator++(int)
@@ -31,7 +118,7 @@ World::EntityIterator World::EntityIterator::operator++(int)
 
 bool World::EntityIterator::operator==(const EntityIterator& other) const
 {
-    return list_ == other.list_ && entityIndex_ == other.entityIndex_;
+    return list_ == other.list_ && queryArchetype_ == other.queryArchetype_ && row_ == other.row_;
 }
 
 bool World::EntityIterator::operator!=(const EntityIterator& other) const
@@ -41,26 +128,70 @@ bool World::EntityIterator::operator!=(const EntityIterator& other) const
 
 EntityHandle World::EntityIterator::operator*() const
 {
-    return list_->world.getEntityHandle(entityIndex_);
+    return list_->world.getEntityHandle(getEntityId());
+}
+
+EntityId World::EntityIterator::getEntityId() const
+{
+    assert(queryArchetype_ != MaxIndex && row_ > 0);
+    const auto archetype = list_->query.archetypes[queryArchetype_];
+    return list_->world.archetypes_[archetype].entities[row_ - 1];
 }
 
 EntityHandle World::createEntity()
 {
     if (entityIdFreeList_.empty()) {
-        componentMasks_.push_back(0);
+        const auto entityId = static_cast<EntityId>(componentMasks_.size());
+        componentMasks_.emplace_back();
         entityValid_.push_back(false);
+        entityLocations_.emplace_back();
         assert(componentMasks_.size() == entityValid_.size());
-        return EntityHandle(*this, componentMasks_.size() - 1);
+        setArchetype(entityId, ComponentMask());
+        unflushedEntities_.push_back(entityId);
+        return EntityHandle(*this, entityId);
     } else {
-        const auto entityId = entityIdFreeList_.top();
-        entityIdFreeList_.pop();
+        const auto entityId = entityIdFreeList_.pop();
         assert(entityId < componentMasks_.size() && entityId < entityValid_.size());
-        componentMasks_[entityId] = 0;
+        componentMasks_[entityId] = ComponentMask();
         entityValid_[entityId] = false;
+        setArchetype(entityId, ComponentMask());
+        unflushedEntities_.push_back(entityId);
         return EntityHandle(*this, entityId);
     }
 }
 
+EntityId World::allocateEntities(size_t count, const ComponentMask& mask)
+{
+    assert(iterationDepth_ == 0);
+    const auto first = static_cast<EntityId>(componentMasks_.size());
+    const auto end = first + count;
+    assert(end <= InvalidEntity);
+    componentMasks_.resize(end, mask);
+    entityValid_.resize(end, false);
+    entityLocations_.resize(end);
+    unflushedEntities_.reserve(unflushedEntities_.size() + count);
+
+    std::vector<EntityId> entityIds(count);
+    for (size_t i = 0; i < count; ++i)
+        entityIds[i] = static_cast<EntityId>(first + i);
+
+    const auto archetypeIndex = getArchetypeIndex(mask);
+    auto& entities = archetypes_[archetypeIndex].entities;
+    entities.reserve(entities.size() + count);
+    for (const auto entityId : entityIds) {
+        entityLocations_[entityId]
+            = EntityLocation { archetypeIndex, static_cast<IndexType>(entities.size()) };
+        entities.push_back(entityId);
+        unflushedEntities_.push_back(entityId);
+    }
+
+    mask.forEachSetBit([this, &entityIds](size_t compId) {
+        assert(pools_[compId]);
+        pools_[compId]->reserve(entityIds);
+    });
+    return first;
+}
+
 EntityHandle World::getEntityHandle(EntityId entityId)
 {
     assert(entityId < componentMasks_.size()); // entity has existed
@@ -70,18 +201,41 @@ EntityHandle World::getEntityHandle(EntityId entityId)
 void World::destroyEntity(EntityId entityId)
 {
     assert(componentMasks_.size() >= entityId); // entity exists
-    for (size_t compId = 0; compId < pools_.size(); ++compId) {
-        const auto hasComponent = (componentMasks_[entityId] & (1ull << compId)) > 0;
-        if (pools_[compId] && hasComponent)
-            pools_[compId]->remove(entityId);
+    componentMasks_[entityId].forEachSetBit([this, entityId](size_t compId) {
+        assert(pools_[compId]);
+        pools_[compId]->remove(entityId);
+    });
+    componentMasks_[entityId] = ComponentMask();
+    entityValid_[entityId] = false;
+    if (iterationDepth_ > 0) {
+        deferredArchetypeUpdates_.push_back(DeferredArchetypeUpdate { entityId, true });
+        return;
     }
-    componentMasks_[entityId] = 0;
+    removeFromArchetype(entityId);
     entityIdFreeList_.push(entityId);
 }
 
+void World::clear()
+{
+    assert(iterationDepth_ == 0);
+    for (auto& pool : pools_) {
+        if (pool)
+            pool->clear();
+    }
+    componentMasks_.clear();
+    entityValid_.clear();
+    unflushedEntities_.clear();
+    entityLocations_.clear();
+    for (auto& archetype : archetypes_)
+        archetype.entities.clear();
+    entityIdFreeList_.clear();
+}
+
 void World::flush()
 {
-    entityValid_.assign(entityValid_.size(), true);
+    for (const auto entityId : unflushedEntities_)
+        entityValid_[entityId] = true;
+    unflushedEntities_.clear();
 }
 
 void World::flush(EntityId entityId)
@@ -90,10 +244,10 @@ void World::flush(EntityId entityId)
     entityValid_[entityId] = true;
 }
 
-bool World::hasComponents(EntityId entityId, ComponentMask mask) const
+bool World::hasComponents(EntityId entityId, const ComponentMask& mask) const
 {
     assert(componentMasks_.size() > entityId);
-    return (componentMasks_[entityId] & mask) == mask;
+    return componentMasks_[entityId].includes(mask);
 }
 
 ComponentMask World::getComponentMask(EntityId entityId) const
@@ -102,6 +256,182 @@ ComponentMask World::getComponentMask(EntityId entityId) const
     return componentMasks_[entityId];
 }
 
+const World::Query& World::getQuery(const ComponentMask& mask)
+{
+    std::lock_guard<std::mutex> lock(queryMutex_);
+    const auto it = queries_.find(mask);
+    if (it != queries_.end())
+        return it->second;
+    auto& query = queries_.emplace(mask, Query { mask, {} }).first->second;
+    for (IndexType i = 0; i < archetypes_.size(); ++i) {
+        if (archetypes_[i].mask.includes(mask))
+            query.archetypes.push_back(i);
+    }
+    return query;
+}
+
+World::MemoryStats World::getMemoryStats() const
+{
+    MemoryStats stats;
+    stats.entityBytes = componentMasks_.capacity() * sizeof(ComponentMask)
+        + entityValid_.capacity() / 8 + unflushedEntities_.capacity() * sizeof(EntityId)
+        + entityLocations_.capacity() * sizeof(EntityLocation)
+        + archetypes_.capacity() * sizeof(Archetype) + entityIdFreeList_.getMemoryBytes();
+    for (const auto& archetype : archetypes_)
+        stats.entityBytes += archetype.entities.capacity() * sizeof(EntityId);
+    stats.totalBytes = stats.entityBytes;
+    for (size_t compId = 0; compId < pools_.size(); ++compId) {
+        if (pools_[compId]) {
+            auto poolStats = pools_[compId]->getMemoryStats();
+            poolStats.componentId = compId;
+            stats.totalBytes += poolStats.bytes;
+            stats.components.push_back(poolStats);
+        }
+    }
+    stats.retainedBlockBytes = blockAllocator_.getRetainedBytes();
+    stats.totalBytes += stats.retainedBlockBytes;
+    return stats;
+}
+
+bool World::saveSnapshot(Snapshot& snapshot) const
+{
+    assert(iterationDepth_ == 0);
+    snapshot.world_ = this;
+    snapshot.componentMasks_ = componentMasks_;
+    snapshot.entityValid_ = entityValid_;
+    snapshot.unflushedEntities_ = unflushedEntities_;
+    snapshot.entityLocations_ = entityLocations_;
+    snapshot.archetypeEntities_.resize(archetypes_.size());
+    for (size_t i = 0; i < archetypes_.size(); ++i)
+        snapshot.archetypeEntities_[i] = archetypes_[i].entities;
+    snapshot.entityIdFreeList_ = entityIdFreeList_;
+    for (size_t compId = 0; compId < pools_.size(); ++compId) {
+        if (!pools_[compId]) {
+            snapshot.pools_[compId].reset();
+        } else if (!pools_[compId]->saveSnapshot(snapshot.pools_[compId])) {
+            snapshot.world_ = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+void World::restoreSnapshot(const Snapshot& snapshot)
+{
+    assert(snapshot.world_ == this);
+    assert(iterationDepth_ == 0);
+    componentMasks_ = snapshot.componentMasks_;
+    entityValid_ = snapshot.entityValid_;
+    unflushedEntities_ = snapshot.unflushedEntities_;
+    entityLocations_ = snapshot.entityLocations_;
+    // Archetypes are never removed, so the ones in the snapshot have the same indices
+    assert(snapshot.archetypeEntities_.size() <= archetypes_.size());
+    for (size_t i = 0; i < archetypes_.size(); ++i) {
+        if (i < snapshot.archetypeEntities_.size())
+            archetypes_[i].entities = snapshot.archetypeEntities_[i];
+        else
+            archetypes_[i].entities.clear();
+    }
+    entityIdFreeList_ = snapshot.entityIdFreeList_;
+    const auto version = getVersion();
+    for (size_t compId = 0; compId < pools_.size(); ++compId) {
+        // Pools are never removed either
+        assert(!snapshot.pools_[compId] || pools_[compId]);
+        if (snapshot.pools_[compId])
+            pools_[compId]->restoreSnapshot(*snapshot.pools_[compId], version);
+        else if (pools_[compId])
+            pools_[compId]->clear();
+    }
+}
+
+void World::beginIteration()
+{
+    iterationDepth_++;
+}
+
+void World::endIteration()
+{
+    assert(iterationDepth_ > 0);
+    if (--iterationDepth_ > 0)
+        return;
+    for (const auto& update : deferredArchetypeUpdates_) {
+        if (update.destroyed) {
+            removeFromArchetype(update.entityId);
+            entityIdFreeList_.push(update.entityId);
+        } else {
+            // The mask might have changed more than once
+            const auto& location = entityLocations_[update.entityId];
+            const auto& mask = componentMasks_[update.entityId];
+            if (location.archetype == MaxIndex || archetypes_[location.archetype].mask != mask)
+                setArchetype(update.entityId, mask);
+        }
+    }
+    deferredArchetypeUpdates_.clear();
+}
+
+IndexType World::getArchetypeIndex(const ComponentMask& mask)
+{
+    const auto it = archetypeIndices_.find(mask);
+    if (it != archetypeIndices_.end())
+        return it->second;
+    const auto index = static_cast<IndexType>(archetypes_.size());
+    archetypes_.push_back(Archetype { mask, {} });
+    archetypeIndices_.emplace(mask, index);
+    for (auto& [queryMask, query] : queries_) {
+        if (mask.includes(queryMask))
+            query.archetypes.push_back(index);
+    }
+    return index;
+}
+
+void World::beginParallelAccess(const ComponentAccess& access)
+{
+    std::lock_guard<std::mutex> lock(parallelAccessMutex_);
+    for (const auto& other : parallelAccesses_) {
+        assert(!access.conflicts(other) && "Conflicting parallel component access");
+    }
+    parallelAccesses_.push_back(access);
+}
+
+void World::endParallelAccess(const ComponentAccess& access)
+{
+    std::lock_guard<std::mutex> lock(parallelAccessMutex_);
+    const auto it = std::find_if(parallelAccesses_.begin(), parallelAccesses_.end(),
+        [&access](const ComponentAccess& other) {
+            return other.read == access.read && other.write == access.write;
+        });
+    assert(it != parallelAccesses_.end());
+    parallelAccesses_.erase(it);
+}
+
+void World::removeFromArchetype(EntityId entityId)
+{
+    auto& location = entityLocations_[entityId];
+    if (location.archetype == MaxIndex)
+        return;
+    auto& entities = archetypes_[location.archetype].entities;
+    assert(location.row < entities.size() && entities[location.row] == entityId);
+    const auto last = entities.back();
+    entities[location.row] = last;
+    entityLocations_[last].row = location.row;
+    entities.pop_back();
+    location = EntityLocation {};
+}
+
+void World::setArchetype(EntityId entityId, const ComponentMask& mask)
+{
+    if (iterationDepth_ > 0) {
+        deferredArchetypeUpdates_.push_back(DeferredArchetypeUpdate { entityId, false });
+        return;
+    }
+    removeFromArchetype(entityId);
+    const auto archetypeIndex = getArchetypeIndex(mask);
+    auto& entities = archetypes_[archetypeIndex].entities;
+    entityLocations_[entityId]
+        = EntityLocation { archetypeIndex, static_cast<IndexType>(entities.size()) };
+    entities.push_back(entityId);
+}
+
 // EntityHandle implementation
 
 void EntityHandle::destroy()
@@ -5,19 +5,30 @@
 #include <atomic>
 #include <bitset>
 #include <cassert>
+#include <cstring>
 #include <limits>
-#include <queue>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <tuple>
 #include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
+#include "bitmask.hpp"
+#include "threadpool.hpp"
+
 namespace ecs {
 
-using ComponentMask = uint64_t;
-static_assert(std::is_unsigned<ComponentMask>::value, "ComponentMask type must be unsigned");
-static const ComponentMask AllComponents = std::numeric_limits<ComponentMask>::max();
-static const size_t MaxComponents = std::numeric_limits<ComponentMask>::digits;
+// Set with -DECS_MAX_COMPONENTS=N, where N is a multiple of 64
+#ifndef ECS_MAX_COMPONENTS
+#define ECS_MAX_COMPONENTS 128
+#endif
+
+using ComponentMask = BitMask<ECS_MAX_COMPONENTS>;
+static const ComponentMask AllComponents = ComponentMask::all();
+static const size_t MaxComponents = ECS_MAX_COMPONENTS;
 
 using EntityId = uint32_t;
 static const EntityId InvalidEntity = std::numeric_limits<EntityId>::max();
@@ -25,6 +36,10 @@ static const EntityId InvalidEntity = std::numeric_limits<EntityId>::max();
 using IndexType = uint32_t;
 static const IndexType MaxIndex = std::numeric_limits<IndexType>::max();
 
+// Components are stamped with the current World version whenever they are added or accessed
+// mutably. Version 0 is never used, so every component has changed since 0.
+using Version = uint32_t;
+
 // I did it in a dumb way before and now I borrowed from EnTT. Thanks, skypjack!
 namespace componentId {
     size_t getNextId();
@@ -38,27 +53,215 @@ namespace componentId {
 }
 
 template <typename... Args>
-constexpr ComponentMask componentMask()
+ComponentMask componentMask()
+{
+    ComponentMask mask;
+    (mask.set(componentId::get<typename std::remove_const<Args>::type>()), ...);
+    return mask;
+}
+
+template <bool isConst, typename ComponentType>
+ComponentMask constFilteredComponentMaskSingle()
+{
+    if constexpr (std::is_const<ComponentType>::value == isConst) {
+        return componentMask<ComponentType>();
+    } else {
+        return ComponentMask();
+    }
+}
+
+template <bool isConst, typename... Args>
+ComponentMask constFilteredComponentMask()
+{
+    return (... | constFilteredComponentMaskSingle<isConst, Args>());
+}
+
+// Which components a system or parallel job reads and writes. Write access is derived from
+// non-const component types, read access from const ones.
+struct ComponentAccess {
+    ComponentMask read;
+    ComponentMask write;
+
+    bool conflicts(const ComponentAccess& other) const
+    {
+        return write.intersects(other.read | other.write) || read.intersects(other.write);
+    }
+};
+
+template <typename... Components>
+ComponentAccess componentAccess()
 {
-    constexpr auto one = static_cast<ComponentMask>(1);
-    return (... | (one << componentId::get<typename std::remove_const<Args>::type>()));
+    return ComponentAccess { constFilteredComponentMask<true, Components...>(),
+        constFilteredComponentMask<false, Components...>() };
 }
 
+// Hands out the memory for ComponentPool blocks. Freed blocks are kept in a free list per size
+// and reused as long as no more than maxRetainedBytes are kept, so entities being created and
+// destroyed at a block boundary don't go to the system allocator every time.
+// Like all structural changes, this must not be used from multiple threads at once.
+class BlockAllocator {
+public:
+    static constexpr size_t DefaultMaxRetainedBytes = 4 * 1024 * 1024;
+
+    BlockAllocator() = default;
+    ~BlockAllocator();
+    BlockAllocator(const BlockAllocator& other) = delete;
+    BlockAllocator& operator=(const BlockAllocator& other) = delete;
+
+    void* allocate(size_t size);
+    void free(void* ptr, size_t size);
+
+    // Releases retained blocks until no more than maxBytes are retained
+    void setMaxRetainedBytes(size_t maxBytes);
+
+    size_t getRetainedBytes() const
+    {
+        return retainedBytes_;
+    }
+
+private:
+    void release(size_t maxBytes);
+
+    std::unordered_map<size_t, std::vector<void*>> freeLists_;
+    size_t retainedBytes_ = 0;
+    size_t maxRetainedBytes_ = DefaultMaxRetainedBytes;
+};
+
+// The ids of destroyed entities, one bit per id. pop returns the lowest id, so lower ids are
+// filled first, and only scans words from the lowest one that might have a bit set.
+class EntityIdFreeList {
+public:
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    void push(EntityId entityId);
+    EntityId pop();
+    void clear();
+
+    size_t getMemoryBytes() const
+    {
+        return words_.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    std::vector<uint64_t> words_;
+    // All words before this one are 0
+    size_t firstWord_ = 0;
+    size_t size_ = 0;
+};
+
+struct ComponentMemoryStats {
+    size_t componentId = 0;
+    // Implementation defined (typeid), might be mangled
+    const char* typeName = nullptr;
+    size_t componentCount = 0;
+    // Storage of the components, their versions and the pool's bookkeeping
+    size_t bytes = 0;
+    // Allocated blocks, 0 for sparse pools
+    size_t blockCount = 0;
+    // Components / allocated slots
+    float occupancy = 0.0f;
+    // 1 - (blocks needed if the components were packed) / allocated blocks
+    float fragmentation = 0.0f;
+};
+
+struct ComponentPoolSnapshot {
+    virtual ~ComponentPoolSnapshot() = default;
+};
+
 struct ComponentPoolBase {
     virtual ~ComponentPoolBase() = default;
     virtual void remove(EntityId entityId) = 0;
+    // Allocates storage for components of all the passed entities at once
+    virtual void reserve(const std::vector<EntityId>& entityIds) = 0;
+    // Removes all components
+    virtual void clear() = 0;
+    // Copies all components into snapshot, reusing its buffers if it is not null. Returns false
+    // if the component type can not be copied (see SnapshotHook).
+    virtual bool saveSnapshot(std::unique_ptr<ComponentPoolSnapshot>& snapshot) const = 0;
+    // Restored components are stamped with version
+    virtual void restoreSnapshot(const ComponentPoolSnapshot& snapshot, Version version) = 0;
+    virtual ComponentMemoryStats getMemoryStats() const = 0;
 };
 
+// Trivially copyable components are snapshotted with memcpy, all others with copy. Specialize this
+// for components that are not copy constructible, but can still be copied in some way.
+template <typename ComponentType>
+struct SnapshotHook {
+    static constexpr bool Supported = std::is_copy_constructible_v<ComponentType>;
+
+    static ComponentType copy(const ComponentType& component)
+    {
+        return component;
+    }
+};
+
+// https://gist.github.com/pfirsich/72ec22c4407013eccfab3a78f2ac7a23
+namespace componentTraits {
+    static constexpr size_t DefaultBlockSize = 64;
+
+    template <class T>
+    constexpr size_t getBlockSizeImpl(const T* /*t*/, ...)
+    {
+        return DefaultBlockSize;
+    }
+
+    template <class T>
+    constexpr typename std::enable_if_t<!std::is_void_v<decltype(T::BlockSize)>, size_t>
+    getBlockSizeImpl(const T* /*t*/, int)
+    {
+        return T::BlockSize;
+    }
+
+    template <class T>
+    constexpr size_t getBlockSize()
+    {
+        return getBlockSizeImpl(static_cast<T*>(nullptr), 0);
+    }
+
+    template <class T>
+    constexpr bool getSparseStorageImpl(const T* /*t*/, ...)
+    {
+        return false;
+    }
+
+    template <class T>
+    constexpr typename std::enable_if_t<!std::is_void_v<decltype(T::SparseStorage)>, bool>
+    getSparseStorageImpl(const T* /*t*/, int)
+    {
+        return T::SparseStorage;
+    }
+
+    // Components that only few entities have can opt into a SparseComponentPool with:
+    // static constexpr bool SparseStorage = true;
+    template <class T>
+    constexpr bool getSparseStorage()
+    {
+        return getSparseStorageImpl(static_cast<T*>(nullptr), 0);
+    }
+}
+
 template <typename ComponentType>
 class ComponentPool : public ComponentPoolBase {
 public:
-    ComponentPool() = default;
+    explicit ComponentPool(BlockAllocator& allocator)
+        : allocator_(allocator)
+    {
+    }
+
     ~ComponentPool();
     ComponentPool(const ComponentPool& other) = delete;
     ComponentPool& operator=(const ComponentPool& other) = delete;
 
     template <typename... Args>
-    ComponentType& add(EntityId entityId, Args... args);
+    ComponentType& add(EntityId entityId, Version version, Args... args);
 
     bool has(EntityId entityId) const;
 
@@ -66,28 +269,36 @@ public:
 
     ComponentType* getPtr(EntityId entityId);
 
+    // May be called from parallel jobs for different entities
+    void setVersion(EntityId entityId, Version version);
+
+    Version getVersion(EntityId entityId) const;
+
+    // Calls func(EntityId) for every component with a version greater than since. Blocks that
+    // have not changed since are skipped as a whole.
+    template <typename FuncType>
+    void forEachChanged(Version since, FuncType func) const;
+
     void remove(EntityId entityId) override;
 
-    static constexpr size_t DefaultBlockSize = 64;
+    void reserve(const std::vector<EntityId>& entityIds) override;
 
-private:
-    // https://gist.github.com/pfirsich/72ec22c4407013eccfab3a78f2ac7a23
-    template <class T>
-    static constexpr size_t getBlockSizeImpl(const T* /*t*/, ...)
-    {
-        return DefaultBlockSize;
-    }
+    void clear() override;
 
-    template <class T>
-    static constexpr typename std::enable_if_t<!std::is_void_v<decltype(T::BlockSize)>, size_t>
-    getBlockSizeImpl(const T* /*t*/, int)
-    {
-        return T::BlockSize;
-    }
+    bool saveSnapshot(std::unique_ptr<ComponentPoolSnapshot>& snapshot) const override;
+
+    void restoreSnapshot(const ComponentPoolSnapshot& snapshot, Version version) override;
 
-    static const size_t BlockSize = getBlockSizeImpl(static_cast<ComponentType*>(nullptr), 0);
+    ComponentMemoryStats getMemoryStats() const override;
+
+private:
+    static const size_t BlockSize = componentTraits::getBlockSize<ComponentType>();
     static_assert(BlockSize > 0);
     static const size_t COMPONENT_SIZE = sizeof(ComponentType);
+    // The versions are stored in the same allocation, behind the components
+    static constexpr size_t VersionsOffset
+        = (BlockSize * COMPONENT_SIZE + alignof(Version) - 1) / alignof(Version) * alignof(Version);
+    static constexpr size_t BlockBytes = VersionsOffset + BlockSize * sizeof(Version);
 
     static constexpr std::pair<size_t, size_t> getIndices(EntityId entityId)
     {
@@ -102,26 +313,76 @@ private:
 
     void checkBlockUsage(size_t blockIndex);
 
+    // Destroys all components, but keeps the blocks allocated
+    void destroyAll();
+
+    struct Snapshot : public ComponentPoolSnapshot {
+        std::vector<std::bitset<BlockSize>> occupied;
+        // Trivially copyable components are copied block by block into data, all others are
+        // copied into components in the order they are stored in the pool.
+        std::vector<uint8_t> data;
+        std::vector<ComponentType> components;
+    };
+
     struct Block {
         void* data = nullptr;
+        Version* versions = nullptr;
+        // Maximum of versions. Slots of the same block may be stamped from different threads.
+        std::atomic<Version> maxVersion { 0 };
         std::bitset<BlockSize> occupied;
+
+        Block() = default;
+
+        // Only moved when blocks_ is resized, which never happens concurrently
+        Block(Block&& other)
+            : data(other.data)
+            , versions(other.versions)
+            , maxVersion(other.maxVersion.load(std::memory_order_relaxed))
+            , occupied(other.occupied)
+        {
+            other.data = nullptr;
+            other.versions = nullptr;
+        }
     };
 
+    void allocateBlock(Block& block);
+    void freeBlock(Block& block);
+
+    BlockAllocator& allocator_;
     std::vector<Block> blocks_;
 };
 
 template <typename ComponentType>
 ComponentPool<ComponentType>::~ComponentPool()
 {
-    for (auto& block : blocks_) {
-        operator delete(block.data);
-        block.data = nullptr;
-    }
+    destroyAll();
+    for (auto& block : blocks_)
+        freeBlock(block);
+}
+
+template <typename ComponentType>
+void ComponentPool<ComponentType>::allocateBlock(Block& block)
+{
+    assert(!block.data);
+    block.data = allocator_.allocate(BlockBytes);
+    block.versions = reinterpret_cast<Version*>(static_cast<uint8_t*>(block.data) + VersionsOffset);
+    std::fill(block.versions, block.versions + BlockSize, 0);
+    block.maxVersion.store(0, std::memory_order_relaxed);
+}
+
+template <typename ComponentType>
+void ComponentPool<ComponentType>::freeBlock(Block& block)
+{
+    if (!block.data)
+        return;
+    allocator_.free(block.data, BlockBytes);
+    block.data = nullptr;
+    block.versions = nullptr;
 }
 
 template <typename ComponentType>
 template <typename... Args>
-ComponentType& ComponentPool<ComponentType>::add(EntityId entityId, Args... args)
+ComponentType& ComponentPool<ComponentType>::add(EntityId entityId, Version version, Args... args)
 {
     assert(!has(entityId));
     const auto [blockIndex, componentIndex] = getIndices(entityId);
@@ -130,10 +391,11 @@ ComponentType& ComponentPool<ComponentType>::add(EntityId entityId, Args... args
         blocks_.resize(blockIndex + 1);
     auto& block = blocks_[blockIndex];
     if (!block.data)
-        block.data = operator new(BlockSize* COMPONENT_SIZE);
+        allocateBlock(block);
     block.occupied[componentIndex] = true;
     auto component
         = new (getPointer(blockIndex, componentIndex)) ComponentType(std::forward<Args>(args)...);
+    setVersion(entityId, version);
 
     return *component;
 }
@@ -162,6 +424,43 @@ ComponentType* ComponentPool<ComponentType>::getPtr(EntityId entityId)
     return getPointer(blockIndex, componentIndex);
 }
 
+template <typename ComponentType>
+void ComponentPool<ComponentType>::setVersion(EntityId entityId, Version version)
+{
+    assert(has(entityId));
+    const auto [blockIndex, componentIndex] = getIndices(entityId);
+    auto& block = blocks_[blockIndex];
+    block.versions[componentIndex] = version;
+    // The World version only ever increases, so this is rarely more than a load
+    auto maxVersion = block.maxVersion.load(std::memory_order_relaxed);
+    while (maxVersion < version
+        && !block.maxVersion.compare_exchange_weak(maxVersion, version, std::memory_order_relaxed))
+        ;
+}
+
+template <typename ComponentType>
+Version ComponentPool<ComponentType>::getVersion(EntityId entityId) const
+{
+    assert(has(entityId));
+    const auto [blockIndex, componentIndex] = getIndices(entityId);
+    return blocks_[blockIndex].versions[componentIndex];
+}
+
+template <typename ComponentType>
+template <typename FuncType>
+void ComponentPool<ComponentType>::forEachChanged(Version since, FuncType func) const
+{
+    for (size_t blockIndex = 0; blockIndex < blocks_.size(); ++blockIndex) {
+        const auto& block = blocks_[blockIndex];
+        if (!block.data || block.maxVersion.load(std::memory_order_relaxed) <= since)
+            continue;
+        for (size_t i = 0; i < BlockSize; ++i) {
+            if (block.occupied[i] && block.versions[i] > since)
+                func(static_cast<EntityId>(blockIndex * BlockSize + i));
+        }
+    }
+}
+
 template <typename ComponentType>
 void ComponentPool<ComponentType>::remove(EntityId entityId)
 {
@@ -173,22 +472,392 @@ void ComponentPool<ComponentType>::remove(EntityId entityId)
     checkBlockUsage(blockIndex);
 }
 
+template <typename ComponentType>
+void ComponentPool<ComponentType>::reserve(const std::vector<EntityId>& entityIds)
+{
+    if (entityIds.empty())
+        return;
+    const auto maxEntityId = *std::max_element(entityIds.begin(), entityIds.end());
+    const auto maxBlockIndex = getIndices(maxEntityId).first;
+    if (blocks_.size() < maxBlockIndex + 1)
+        blocks_.resize(maxBlockIndex + 1);
+    for (const auto entityId : entityIds) {
+        auto& block = blocks_[getIndices(entityId).first];
+        if (!block.data)
+            allocateBlock(block);
+    }
+}
+
+template <typename ComponentType>
+void ComponentPool<ComponentType>::destroyAll()
+{
+    for (size_t blockIndex = 0; blockIndex < blocks_.size(); ++blockIndex) {
+        auto& block = blocks_[blockIndex];
+        if constexpr (!std::is_trivially_destructible_v<ComponentType>) {
+            for (size_t i = 0; i < BlockSize; ++i) {
+                if (block.occupied[i])
+                    getPointer(blockIndex, i)->~ComponentType();
+            }
+        }
+        block.occupied.reset();
+    }
+}
+
+template <typename ComponentType>
+void ComponentPool<ComponentType>::clear()
+{
+    destroyAll();
+    for (auto& block : blocks_)
+        freeBlock(block);
+    blocks_.clear();
+}
+
+template <typename ComponentType>
+bool ComponentPool<ComponentType>::saveSnapshot(
+    std::unique_ptr<ComponentPoolSnapshot>& snapshot) const
+{
+    if constexpr (!std::is_trivially_copyable_v<ComponentType>
+        && !SnapshotHook<ComponentType>::Supported) {
+        return false;
+    } else {
+        if (!snapshot)
+            snapshot = std::make_unique<Snapshot>();
+        auto& dst = static_cast<Snapshot&>(*snapshot);
+        dst.occupied.resize(blocks_.size());
+        for (size_t blockIndex = 0; blockIndex < blocks_.size(); ++blockIndex)
+            dst.occupied[blockIndex] = blocks_[blockIndex].occupied;
+
+        if constexpr (std::is_trivially_copyable_v<ComponentType>) {
+            static constexpr auto blockBytes = BlockSize * COMPONENT_SIZE;
+            dst.data.resize(blocks_.size() * blockBytes);
+            for (size_t blockIndex = 0; blockIndex < blocks_.size(); ++blockIndex) {
+                if (blocks_[blockIndex].data)
+                    std::memcpy(
+                        dst.data.data() + blockIndex * blockBytes, blocks_[blockIndex].data, blockBytes);
+            }
+        } else {
+            dst.components.clear();
+            for (const auto& block : blocks_) {
+                for (size_t i = 0; i < BlockSize; ++i) {
+                    if (block.occupied[i])
+                        dst.components.push_back(SnapshotHook<ComponentType>::copy(
+                            reinterpret_cast<const ComponentType*>(block.data)[i]));
+                }
+            }
+        }
+        return true;
+    }
+}
+
+template <typename ComponentType>
+void ComponentPool<ComponentType>::restoreSnapshot(
+    const ComponentPoolSnapshot& snapshot, Version version)
+{
+    if constexpr (!std::is_trivially_copyable_v<ComponentType>
+        && !SnapshotHook<ComponentType>::Supported) {
+        assert(false && "Component type can not be snapshotted");
+    } else {
+        const auto& src = static_cast<const Snapshot&>(snapshot);
+        destroyAll();
+        for (size_t blockIndex = src.occupied.size(); blockIndex < blocks_.size(); ++blockIndex)
+            freeBlock(blocks_[blockIndex]);
+        blocks_.resize(src.occupied.size());
+
+        size_t componentIndex = 0;
+        for (size_t blockIndex = 0; blockIndex < blocks_.size(); ++blockIndex) {
+            auto& block = blocks_[blockIndex];
+            block.occupied = src.occupied[blockIndex];
+            if (block.occupied.none()) {
+                freeBlock(block);
+                continue;
+            }
+            if (!block.data)
+                allocateBlock(block);
+
+            if constexpr (std::is_trivially_copyable_v<ComponentType>) {
+                static constexpr auto blockBytes = BlockSize * COMPONENT_SIZE;
+                std::memcpy(block.data, src.data.data() + blockIndex * blockBytes, blockBytes);
+            } else {
+                for (size_t i = 0; i < BlockSize; ++i) {
+                    if (block.occupied[i])
+                        new (getPointer(blockIndex, i)) ComponentType(
+                            SnapshotHook<ComponentType>::copy(src.components[componentIndex++]));
+                }
+            }
+
+            std::fill(block.versions, block.versions + BlockSize, version);
+            block.maxVersion.store(version, std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename ComponentType>
+ComponentMemoryStats ComponentPool<ComponentType>::getMemoryStats() const
+{
+    ComponentMemoryStats stats;
+    stats.typeName = typeid(ComponentType).name();
+    stats.bytes = blocks_.capacity() * sizeof(Block);
+    for (const auto& block : blocks_) {
+        if (block.data) {
+            stats.componentCount += block.occupied.count();
+            stats.bytes += BlockBytes;
+            stats.blockCount++;
+        }
+    }
+    if (stats.blockCount > 0) {
+        stats.occupancy = static_cast<float>(stats.componentCount) / (stats.blockCount * BlockSize);
+        const auto minBlocks = (stats.componentCount + BlockSize - 1) / BlockSize;
+        stats.fragmentation = 1.0f - static_cast<float>(minBlocks) / stats.blockCount;
+    }
+    return stats;
+}
+
 template <typename ComponentType>
 void ComponentPool<ComponentType>::checkBlockUsage(size_t blockIndex)
 {
     auto& block = blocks_[blockIndex];
-    if (block.occupied.none()) { // block is unused
-        operator delete(block.data);
-        block.data = nullptr;
+    if (block.occupied.none()) // block is unused
+        freeBlock(block);
+}
+
+// Keeps the components packed in a dense array and maps entity ids to indices into it with a
+// sparse array, so it does not allocate whole blocks for a few entities with high ids.
+// Removing a component moves the last one into its place and adding one may reallocate the dense
+// array, so unlike with ComponentPool, references to components are only valid until the next
+// add or remove on the same pool.
+template <typename ComponentType>
+class SparseComponentPool : public ComponentPoolBase {
+public:
+    SparseComponentPool() = default;
+    SparseComponentPool(const SparseComponentPool& other) = delete;
+    SparseComponentPool& operator=(const SparseComponentPool& other) = delete;
+
+    template <typename... Args>
+    ComponentType& add(EntityId entityId, Version version, Args... args);
+
+    bool has(EntityId entityId) const;
+
+    ComponentType& get(EntityId entityId);
+
+    ComponentType* getPtr(EntityId entityId);
+
+    void setVersion(EntityId entityId, Version version);
+
+    Version getVersion(EntityId entityId) const;
+
+    template <typename FuncType>
+    void forEachChanged(Version since, FuncType func) const;
+
+    void remove(EntityId entityId) override;
+
+    void reserve(const std::vector<EntityId>& entityIds) override;
+
+    void clear() override;
+
+    bool saveSnapshot(std::unique_ptr<ComponentPoolSnapshot>& snapshot) const override;
+
+    void restoreSnapshot(const ComponentPoolSnapshot& snapshot, Version version) override;
+
+    ComponentMemoryStats getMemoryStats() const override;
+
+private:
+    struct Snapshot : public ComponentPoolSnapshot {
+        std::vector<IndexType> sparse;
+        std::vector<EntityId> entities;
+        std::vector<ComponentType> components;
+    };
+
+    static void copyComponents(
+        std::vector<ComponentType>& dst, const std::vector<ComponentType>& src);
+
+    // Index into the dense arrays by entity id
+    std::vector<IndexType> sparse_;
+    std::vector<EntityId> entities_;
+    std::vector<ComponentType> components_;
+    std::vector<Version> versions_;
+};
+
+template <typename ComponentType>
+template <typename... Args>
+ComponentType& SparseComponentPool<ComponentType>::add(
+    EntityId entityId, Version version, Args... args)
+{
+    assert(!has(entityId));
+    if (sparse_.size() < entityId + 1)
+        sparse_.resize(entityId + 1, MaxIndex);
+    sparse_[entityId] = static_cast<IndexType>(components_.size());
+    entities_.push_back(entityId);
+    versions_.push_back(version);
+    return components_.emplace_back(std::forward<Args>(args)...);
+}
+
+template <typename ComponentType>
+bool SparseComponentPool<ComponentType>::has(EntityId entityId) const
+{
+    return sparse_.size() > entityId && sparse_[entityId] != MaxIndex;
+}
+
+template <typename ComponentType>
+ComponentType& SparseComponentPool<ComponentType>::get(EntityId entityId)
+{
+    assert(has(entityId));
+    return components_[sparse_[entityId]];
+}
+
+template <typename ComponentType>
+ComponentType* SparseComponentPool<ComponentType>::getPtr(EntityId entityId)
+{
+    if (!has(entityId))
+        return nullptr;
+    return &components_[sparse_[entityId]];
+}
+
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::setVersion(EntityId entityId, Version version)
+{
+    assert(has(entityId));
+    versions_[sparse_[entityId]] = version;
+}
+
+template <typename ComponentType>
+Version SparseComponentPool<ComponentType>::getVersion(EntityId entityId) const
+{
+    assert(has(entityId));
+    return versions_[sparse_[entityId]];
+}
+
+template <typename ComponentType>
+template <typename FuncType>
+void SparseComponentPool<ComponentType>::forEachChanged(Version since, FuncType func) const
+{
+    // Backwards, so removing the current component in func moves one that was visited already
+    for (size_t i = entities_.size(); i-- > 0;) {
+        if (versions_[i] > since)
+            func(entities_[i]);
+    }
+}
+
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::remove(EntityId entityId)
+{
+    assert(has(entityId));
+    const auto index = sparse_[entityId];
+    const auto last = static_cast<IndexType>(components_.size() - 1);
+    if (index != last) {
+        components_[index] = std::move(components_[last]);
+        entities_[index] = entities_[last];
+        versions_[index] = versions_[last];
+        sparse_[entities_[index]] = index;
     }
+    components_.pop_back();
+    entities_.pop_back();
+    versions_.pop_back();
+    sparse_[entityId] = MaxIndex;
+}
+
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::reserve(const std::vector<EntityId>& entityIds)
+{
+    if (entityIds.empty())
+        return;
+    const auto maxEntityId = *std::max_element(entityIds.begin(), entityIds.end());
+    if (sparse_.size() < maxEntityId + 1)
+        sparse_.resize(maxEntityId + 1, MaxIndex);
+    const auto size = components_.size() + entityIds.size();
+    entities_.reserve(size);
+    components_.reserve(size);
+    versions_.reserve(size);
+}
+
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::clear()
+{
+    sparse_.clear();
+    entities_.clear();
+    components_.clear();
+    versions_.clear();
 }
 
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::copyComponents(
+    std::vector<ComponentType>& dst, const std::vector<ComponentType>& src)
+{
+    if constexpr (std::is_trivially_copyable_v<ComponentType>) {
+        dst = src;
+    } else {
+        dst.clear();
+        dst.reserve(src.size());
+        for (const auto& component : src)
+            dst.push_back(SnapshotHook<ComponentType>::copy(component));
+    }
+}
+
+template <typename ComponentType>
+bool SparseComponentPool<ComponentType>::saveSnapshot(
+    std::unique_ptr<ComponentPoolSnapshot>& snapshot) const
+{
+    if constexpr (!std::is_trivially_copyable_v<ComponentType>
+        && !SnapshotHook<ComponentType>::Supported) {
+        return false;
+    } else {
+        if (!snapshot)
+            snapshot = std::make_unique<Snapshot>();
+        auto& dst = static_cast<Snapshot&>(*snapshot);
+        dst.sparse = sparse_;
+        dst.entities = entities_;
+        copyComponents(dst.components, components_);
+        return true;
+    }
+}
+
+template <typename ComponentType>
+void SparseComponentPool<ComponentType>::restoreSnapshot(
+    const ComponentPoolSnapshot& snapshot, Version version)
+{
+    if constexpr (!std::is_trivially_copyable_v<ComponentType>
+        && !SnapshotHook<ComponentType>::Supported) {
+        assert(false && "Component type can not be snapshotted");
+    } else {
+        const auto& src = static_cast<const Snapshot&>(snapshot);
+        sparse_ = src.sparse;
+        entities_ = src.entities;
+        copyComponents(components_, src.components);
+        versions_.assign(entities_.size(), version);
+    }
+}
+
+template <typename ComponentType>
+ComponentMemoryStats SparseComponentPool<ComponentType>::getMemoryStats() const
+{
+    ComponentMemoryStats stats;
+    stats.typeName = typeid(ComponentType).name();
+    stats.componentCount = components_.size();
+    stats.bytes = sparse_.capacity() * sizeof(IndexType) + entities_.capacity() * sizeof(EntityId)
+        + components_.capacity() * sizeof(ComponentType) + versions_.capacity() * sizeof(Version);
+    if (components_.capacity() > 0)
+        stats.occupancy = static_cast<float>(components_.size()) / components_.capacity();
+    return stats;
+}
+
+template <typename ComponentType>
+using ComponentPoolType = std::conditional_t<componentTraits::getSparseStorage<ComponentType>(),
+    SparseComponentPool<ComponentType>, ComponentPool<ComponentType>>;
+
 class EntityHandle;
+class CommandBuffer;
 
 class World {
 public:
     struct EntityList;
+    struct Query;
 
+private:
+    struct EntityLocation {
+        IndexType archetype = MaxIndex;
+        IndexType row = MaxIndex;
+    };
+
+public:
     class EntityIterator {
         // To be used with std::for_each, this has to be a ForwardIterator:
         // https://en.cppreference.com/w/cpp/named_req/ForwardIterator
@@ -205,9 +874,10 @@ public:
         EntityIterator(const EntityIterator& other) = default;
         EntityIterator& operator=(const EntityIterator& other) = default;
 
-        EntityIterator(EntityList* list, IndexType index)
+        EntityIterator(EntityList* list, IndexType queryArchetype, IndexType row)
             : list_(list)
-            , entityIndex_(index)
+            , queryArchetype_(queryArchetype)
+            , row_(row)
         {
         }
 
@@ -222,39 +892,87 @@ public:
             return list_;
         }
 
-        IndexType getIndex() const
-        {
-            return entityIndex_;
-        }
+        EntityId getEntityId() const;
 
     private:
         EntityList* list_ = nullptr;
-        IndexType entityIndex_ = MaxIndex;
+        // Index into Query::archetypes
+        IndexType queryArchetype_ = MaxIndex;
+        // Archetypes are iterated back to front (see operator++), so this is the number of entities
+        // in the archetype that have not been visited yet.
+        IndexType row_ = 0;
     };
 
+    // While an EntityList exists, entities are not moved between archetypes (see
+    // beginIteration), so iterating it visits every entity that matched when it was created once.
     struct EntityList {
-        EntityList(World& world, ComponentMask mask)
+        EntityList(World& world, const Query& query)
             : world(world)
-            , mask(mask)
+            , query(query)
         {
+            world.beginIteration();
         }
 
-        ~EntityList() = default;
+        ~EntityList()
+        {
+            world.endIteration();
+        }
+
+        EntityList(const EntityList& other) = delete;
+        EntityList& operator=(const EntityList& other) = delete;
 
         EntityIterator begin()
         {
             // start at -1 and increment to get an invalid iterator if no entity matches
             // is this hackish?
-            return ++EntityIterator(this, MaxIndex);
+            return ++EntityIterator(this, MaxIndex, 0);
         }
 
         EntityIterator end()
         {
-            return EntityIterator(this, MaxIndex);
+            return EntityIterator(this, MaxIndex, 0);
         }
 
         World& world;
+        const Query& query;
+    };
+
+    // All entities with exactly the same component mask are kept together in one archetype, so
+    // that queries only have to check the mask once per archetype and can then walk a packed array
+    // of entity ids. The component data itself stays in the pools, so references returned by
+    // getComponent are not invalidated when an entity changes archetype.
+    struct Archetype {
+        ComponentMask mask;
+        std::vector<EntityId> entities;
+    };
+
+    // A query is registered the first time its mask is passed to entitiesWith and from then on
+    // keeps a list of all archetypes that match it. The list is extended whenever a new archetype
+    // is created, so iterating a query only touches archetypes that contain matching entities.
+    struct Query {
         ComponentMask mask;
+        std::vector<IndexType> archetypes;
+    };
+
+    // A copy of the complete state of a World (see saveSnapshot). Keep snapshots around and save
+    // into them again to reuse their buffers.
+    class Snapshot {
+    public:
+        Snapshot() = default;
+        Snapshot(const Snapshot& other) = delete;
+        Snapshot& operator=(const Snapshot& other) = delete;
+
+    private:
+        friend class World;
+
+        const World* world_ = nullptr;
+        std::vector<ComponentMask> componentMasks_;
+        std::vector<bool> entityValid_;
+        std::vector<EntityId> unflushedEntities_;
+        std::vector<EntityLocation> entityLocations_;
+        std::vector<std::vector<EntityId>> archetypeEntities_;
+        EntityIdFreeList entityIdFreeList_;
+        std::array<std::unique_ptr<ComponentPoolSnapshot>, MaxComponents> pools_;
     };
 
 public:
@@ -264,14 +982,27 @@ public:
     World& operator=(const World& other) = delete;
 
     EntityHandle createEntity();
+
+    // Creates count entities with contiguous ids (ignoring the free list) and returns the first
+    // id. The entities start with default constructed Components and are put into the archetype
+    // of those directly, so they don't pass through an archetype for every component added.
+    template <typename... Components>
+    EntityId createEntities(size_t count);
+
     EntityHandle getEntityHandle(EntityId entityId);
 
     void destroyEntity(EntityId entityId);
 
+    // Destroys all entities at once, without removing them one by one. Archetypes, queries, pool
+    // blocks retained by the BlockAllocator and the capacity of all containers are kept, so the
+    // world can be filled again quickly. Entity ids start at 0 again, so all EntityHandles into
+    // this world become invalid.
+    void clear();
+
     template <typename ComponentType, typename... Args>
     ComponentType& addComponent(EntityId entityId, Args&&... args);
 
-    bool hasComponents(EntityId entityId, ComponentMask mask) const;
+    bool hasComponents(EntityId entityId, const ComponentMask& mask) const;
 
     template <typename... Args>
     bool hasComponents(EntityId entityId) const;
@@ -287,6 +1018,30 @@ public:
     template <typename ComponentType>
     void removeComponent(EntityId entityId);
 
+    Version getVersion() const
+    {
+        return version_.load(std::memory_order_relaxed);
+    }
+
+    // Returns the current version and increments it, so every change made after this call has a
+    // greater version. Systems that process changes remember the returned value and pass it as
+    // "since" the next time.
+    Version advanceVersion()
+    {
+        return version_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Whether the component was added or accessed mutably after version since
+    template <typename ComponentType>
+    bool hasChanged(EntityId entityId, Version since);
+
+    // Calls func for every entity with a ComponentType that changed after version since. Entities
+    // that have not been flushed yet are included, so their changes are not lost when since is
+    // advanced. Removed components are not reported. func may remove the ComponentType of the
+    // entity it is called for. The signature of func is the same as for forEachEntity.
+    template <typename ComponentType, typename FuncType>
+    void forEachChanged(Version since, FuncType func);
+
     bool isValid(EntityId entityId) const
     {
         assert(entityId < entityValid_.size());
@@ -301,24 +1056,104 @@ public:
         return componentMasks_.size();
     }
 
+    // func may add or remove components and create or destroy entities. Entities that match only
+    // after the iteration started are not visited and entities that don't match anymore are
+    // skipped.
     template <typename... Components, typename FuncType>
     void forEachEntity(FuncType func);
 
+    // Splits the matching entities into chunks of grainSize and processes them on the ThreadPool.
+    // func is called concurrently, so it must not add or remove components or create or destroy
+    // entities. It is asserted that no other parallelForEach running at the same time writes
+    // components this one accesses or accesses components this one writes.
+    template <typename... Components, typename FuncType>
+    void parallelForEach(FuncType func, size_t grainSize = 256);
+
     template <typename... Components>
     EntityList entitiesWith()
     {
-        return EntityList(*this, componentMask<Components...>());
+        return EntityList(*this, getQuery(componentMask<Components...>()));
+    }
+
+    const Query& getQuery(const ComponentMask& mask);
+
+    struct MemoryStats {
+        // Only components that have a pool
+        std::vector<ComponentMemoryStats> components;
+        // Component masks, archetypes and the like
+        size_t entityBytes = 0;
+        size_t retainedBlockBytes = 0;
+        size_t totalBytes = 0;
+    };
+
+    MemoryStats getMemoryStats() const;
+
+    BlockAllocator& getBlockAllocator()
+    {
+        return blockAllocator_;
     }
 
+    // Returns false if there is a component that can not be copied (see SnapshotHook), in which
+    // case the snapshot can not be restored.
+    bool saveSnapshot(Snapshot& snapshot) const;
+
+    // The snapshot has to be saved from this world. EntityHandles in components point to the world
+    // they were created from, so snapshots can not be moved between worlds. All restored
+    // components count as changed.
+    void restoreSnapshot(const Snapshot& snapshot);
+
 private:
+    friend class CommandBuffer;
+
     std::vector<ComponentMask> componentMasks_;
     std::vector<bool> entityValid_;
-    // the free list is a min heap, so that we try to fill lower indices first
-    std::priority_queue<EntityId, std::vector<EntityId>, std::greater<>> entityIdFreeList_;
+    // Created entities that have not been flushed yet, so flush() doesn't have to touch all
+    std::vector<EntityId> unflushedEntities_;
+    std::vector<EntityLocation> entityLocations_;
+    std::vector<Archetype> archetypes_;
+    std::unordered_map<ComponentMask, IndexType> archetypeIndices_;
+    // Elements of an unordered_map are not moved on rehash, so EntityList can keep a reference
+    std::unordered_map<ComponentMask, Query> queries_;
+    // Parallel jobs might iterate other queries
+    std::mutex queryMutex_;
+    std::mutex parallelAccessMutex_;
+    std::vector<ComponentAccess> parallelAccesses_;
+    EntityIdFreeList entityIdFreeList_;
+    // Has to outlive the pools
+    BlockAllocator blockAllocator_;
     std::array<std::unique_ptr<ComponentPoolBase>, MaxComponents> pools_;
+    std::atomic<Version> version_ { 1 };
+    // Jobs of parallelForEach might iterate other queries
+    std::atomic<size_t> iterationDepth_ { 0 };
+
+    struct DeferredArchetypeUpdate {
+        EntityId entityId;
+        bool destroyed;
+    };
+    std::vector<DeferredArchetypeUpdate> deferredArchetypeUpdates_;
 
     template <typename ComponentType>
-    ComponentPool<ComponentType>& getPool(bool alloc = true);
+    ComponentPoolType<ComponentType>& getPool(bool alloc = true);
+
+    template <typename... Components, typename FuncType>
+    static void invokeEntityFunc(FuncType& func, EntityHandle entity);
+
+    void beginParallelAccess(const ComponentAccess& access);
+    void endParallelAccess(const ComponentAccess& access);
+
+    // Moving an entity to another archetype swaps another entity into its place, so an iterator
+    // could visit that one twice or skip it. While an iteration is running, the moves (and freeing
+    // the ids of destroyed entities) are deferred until the last one ends.
+    void beginIteration();
+    void endIteration();
+
+    IndexType getArchetypeIndex(const ComponentMask& mask);
+    void removeFromArchetype(EntityId entityId);
+    // Deferred during iteration
+    void setArchetype(EntityId entityId, const ComponentMask& mask);
+    // Appends count entities with mask to its archetype and reserves the pools, but does not
+    // construct the components
+    EntityId allocateEntities(size_t count, const ComponentMask& mask);
 };
 
 class EntityHandle {
@@ -373,15 +1208,35 @@ private:
 // Implementation
 
 template <typename ComponentType>
-ComponentPool<ComponentType>& World::getPool(bool alloc)
+ComponentPoolType<ComponentType>& World::getPool(bool alloc)
 {
     const auto compId = componentId::get<ComponentType>();
     assert(compId < pools_.size());
     if (alloc && !pools_[compId]) {
-        pools_[compId] = std::make_unique<ComponentPool<ComponentType>>();
+        if constexpr (componentTraits::getSparseStorage<ComponentType>())
+            pools_[compId] = std::make_unique<SparseComponentPool<ComponentType>>();
+        else
+            pools_[compId] = std::make_unique<ComponentPool<ComponentType>>(blockAllocator_);
     }
     assert(pools_[compId]);
-    return *static_cast<ComponentPool<ComponentType>*>(pools_[compId].get());
+    return *static_cast<ComponentPoolType<ComponentType>*>(pools_[compId].get());
+}
+
+template <typename... Components>
+EntityId World::createEntities(size_t count)
+{
+    static_assert((std::is_default_constructible_v<Components> && ...),
+        "Component types must be default constructible.");
+    (getPool<Components>(), ...);
+    const auto first = allocateEntities(count, componentMask<Components...>());
+    const auto end = static_cast<EntityId>(first + count);
+    const auto version = getVersion();
+    const auto addComponents = [first, end, version](auto& pool) {
+        for (auto entityId = first; entityId < end; ++entityId)
+            pool.add(entityId, version);
+    };
+    (addComponents(getPool<Components>()), ...);
+    return first;
 }
 
 template <typename ComponentType, typename... Args>
@@ -389,8 +1244,9 @@ ComponentType& World::addComponent(EntityId entityId, Args&&... args)
 {
     assert(componentMasks_.size() > entityId);
     assert(!hasComponents<ComponentType>(entityId));
-    componentMasks_[entityId] |= componentMask<ComponentType>();
-    return getPool<ComponentType>().add(entityId, std::forward<Args>(args)...);
+    componentMasks_[entityId].set(componentId::get<ComponentType>());
+    setArchetype(entityId, componentMasks_[entityId]);
+    return getPool<ComponentType>().add(entityId, getVersion(), std::forward<Args>(args)...);
 }
 
 template <typename... Args>
@@ -407,6 +1263,8 @@ ComponentType& World::getComponent(EntityId entityId)
     // this should never trigger an allocation anyways, since we assert hasComponent above,
     // so this is just an extra safety measure
     auto& pool = getPool<typename std::remove_const_t<ComponentType>>(false);
+    if constexpr (!std::is_const_v<ComponentType>)
+        pool.setVersion(entityId, getVersion());
     return pool.get(entityId);
 }
 
@@ -414,36 +1272,42 @@ template <typename ComponentType>
 ComponentType* World::getComponentPtr(EntityId entityId)
 {
     auto& pool = getPool<typename std::remove_const_t<ComponentType>>(true);
-    return pool.getPtr(entityId);
+    const auto ptr = pool.getPtr(entityId);
+    if constexpr (!std::is_const_v<ComponentType>) {
+        if (ptr)
+            pool.setVersion(entityId, getVersion());
+    }
+    return ptr;
 }
 
 template <typename ComponentType>
-void World::removeComponent(EntityId entityId)
+bool World::hasChanged(EntityId entityId, Version since)
 {
-    assert(entityId < componentMasks_.size());
     assert(hasComponents<ComponentType>(entityId));
-    componentMasks_[entityId] &= ~componentMask<ComponentType>();
-    getPool<ComponentType>().remove(entityId);
+    return getPool<typename std::remove_const_t<ComponentType>>(false).getVersion(entityId) > since;
 }
 
-template <bool isConst, typename ComponentType>
-ComponentMask constFilteredComponentMaskSingle()
+template <typename ComponentType, typename FuncType>
+void World::forEachChanged(Version since, FuncType func)
 {
-    if constexpr (std::is_const<ComponentType>::value == isConst) {
-        return componentMask<ComponentType>();
-    } else {
-        return 0;
-    }
+    const auto& pool = getPool<typename std::remove_const_t<ComponentType>>();
+    pool.forEachChanged(since, [this, &func](EntityId entityId) {
+        invokeEntityFunc<ComponentType>(func, getEntityHandle(entityId));
+    });
 }
 
-template <bool isConst, typename... Args>
-ComponentMask constFilteredComponentMask()
+template <typename ComponentType>
+void World::removeComponent(EntityId entityId)
 {
-    return (... | constFilteredComponentMaskSingle<isConst, Args>());
+    assert(entityId < componentMasks_.size());
+    assert(hasComponents<ComponentType>(entityId));
+    componentMasks_[entityId].reset(componentId::get<ComponentType>());
+    setArchetype(entityId, componentMasks_[entityId]);
+    getPool<ComponentType>().remove(entityId);
 }
 
 template <typename... Components, typename FuncType>
-void World::forEachEntity(FuncType func)
+void World::invokeEntityFunc(FuncType& func, EntityHandle entity)
 {
     constexpr auto entityHandleOnly = std::is_invocable_r_v<void, FuncType, EntityHandle>;
     constexpr auto entityHandleAndComponents
@@ -455,20 +1319,70 @@ void World::forEachEntity(FuncType func)
     static_assert((entityHandleOnly && !(entityHandleAndComponents || componentsOnly))
         || (entityHandleAndComponents && !(entityHandleOnly || componentsOnly))
         || (componentsOnly && !(entityHandleAndComponents || entityHandleOnly)));
-    // EntityHandle has to be passed by value to the invokable, because the EntityHandle returned
-    // from the EntityIterator is a temporary
-    auto entityList = entitiesWith<Components...>();
     if constexpr (entityHandleOnly) {
-        std::for_each(entityList.begin(), entityList.end(), func);
+        func(entity);
     } else if constexpr (entityHandleAndComponents) {
-        std::for_each(entityList.begin(), entityList.end(),
-            [func](EntityHandle e) { func(e, e.get<Components>()...); });
+        func(entity, entity.get<Components>()...);
     } else { // componentsOnly
-        std::for_each(entityList.begin(), entityList.end(),
-            [func](EntityHandle e) { func(e.get<Components>()...); });
+        func(entity.get<Components>()...);
     }
 }
 
+template <typename... Components, typename FuncType>
+void World::forEachEntity(FuncType func)
+{
+    // EntityHandle has to be passed by value to the invokable, because the EntityHandle returned
+    // from the EntityIterator is a temporary
+    auto entityList = entitiesWith<Components...>();
+    std::for_each(entityList.begin(), entityList.end(),
+        [&func](EntityHandle e) { invokeEntityFunc<Components...>(func, e); });
+}
+
+template <typename... Components, typename FuncType>
+void World::parallelForEach(FuncType func, size_t grainSize)
+{
+    assert(grainSize > 0);
+    const auto access = componentAccess<Components...>();
+    beginParallelAccess(access);
+
+    // Entities in the archetypes might not match anymore
+    assert(deferredArchetypeUpdates_.empty());
+    const auto& query = getQuery(componentMask<Components...>());
+    auto processRange = [this, &func](const std::vector<EntityId>& entities, size_t start,
+                            size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            if (isValid(entities[i]))
+                invokeEntityFunc<Components...>(func, getEntityHandle(entities[i]));
+        }
+    };
+
+    size_t count = 0;
+    for (const auto archetype : query.archetypes)
+        count += archetypes_[archetype].entities.size();
+
+    if (count <= grainSize) {
+        // Not worth the synchronization
+        for (const auto archetype : query.archetypes) {
+            const auto& entities = archetypes_[archetype].entities;
+            processRange(entities, 0, entities.size());
+        }
+    } else {
+        auto& threadPool = ThreadPool::instance();
+        ThreadPool::TaskGroup group;
+        for (const auto archetype : query.archetypes) {
+            const auto& entities = archetypes_[archetype].entities;
+            for (size_t start = 0; start < entities.size(); start += grainSize) {
+                const auto end = std::min(start + grainSize, entities.size());
+                threadPool.push(group,
+                    [&processRange, &entities, start, end]() { processRange(entities, start, end); });
+            }
+        }
+        threadPool.wait(group);
+    }
+
+    endParallelAccess(access);
+}
+
 template <typename ComponentType, typename... Args>
 ComponentType& EntityHandle::add(Args&&... args)
 {
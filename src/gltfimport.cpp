@@ -32,7 +32,9 @@ std::unordered_map<std::string, size_t> attributeLocations = {
 }
 
 struct GltfFile::ImportCache {
-    std::unordered_map<gltf::NodeIndex, ecs::EntityHandle> entityMap;
+    // Indexed by node index and only valid during instantiate
+    std::vector<ecs::EntityHandle> entities;
+    std::vector<bool> entityInitialized;
     std::unordered_map<gltf::MeshIndex, std::shared_ptr<Mesh>> meshMap;
     std::unordered_map<gltf::BufferViewIndex, std::shared_ptr<glw::Buffer>> bufferMap;
     std::unordered_map<gltf::MaterialIndex, std::shared_ptr<Material>> materialMap;
@@ -203,15 +205,18 @@ struct GltfFile::ImportCache {
     ecs::EntityHandle getEntity(
         ecs::World& world, const gltf::Gltf& gltfFile, gltf::NodeIndex nodeIndex, bool server)
     {
-        const auto it = entityMap.find(nodeIndex);
-        if (it != entityMap.end())
-            return it->second;
+        assert(nodeIndex < entities.size());
+        auto entity = entities[nodeIndex];
+        if (entityInitialized[nodeIndex])
+            return entity;
+        entityInitialized[nodeIndex] = true;
 
+        // The entity was created with a Name, Transform and Hierarchy, which most nodes have
         const auto& node = gltfFile.nodes[nodeIndex];
-        auto entity = world.createEntity();
-        entityMap.emplace(nodeIndex, entity);
         if (node.name) {
-            entity.add<comp::Name>(comp::Name { *node.name });
+            entity.get<comp::Name>().value = *node.name;
+        } else {
+            entity.remove<comp::Name>();
         }
         if (node.name && node.name->find("collider") == 0) {
             assert(!node.parent);
@@ -225,7 +230,8 @@ struct GltfFile::ImportCache {
             const auto scale = (max - min) / 2.0f;
             const auto& trs = std::get<gltf::Node::Trs>(node.transform);
             const auto trsScale = makeGlm<glm::vec3>(trs.scale);
-            entity.add<comp::Transform>().setPosition(
+            entity.remove<comp::Hierarchy>();
+            entity.get<comp::Transform>().setPosition(
                 makeGlm<glm::vec3>(trs.translation) + offset * trsScale);
             entity.add<comp::BoxCollider>().halfExtents = trsScale * scale;
 
@@ -256,11 +262,11 @@ struct GltfFile::ImportCache {
                 }
             }
         } else if (node.name && node.name->find("spawn") == 0) {
-            entity.add<comp::Transform>().setMatrix(makeGlm<glm::mat4>(node.getTransformMatrix()));
+            entity.remove<comp::Hierarchy>();
+            entity.get<comp::Transform>().setMatrix(makeGlm<glm::mat4>(node.getTransformMatrix()));
             entity.add<comp::SpawnPoint>();
         } else {
-            entity.add<comp::Hierarchy>();
-            entity.add<comp::Transform>().setMatrix(makeGlm<glm::mat4>(node.getTransformMatrix()));
+            entity.get<comp::Transform>().setMatrix(makeGlm<glm::mat4>(node.getTransformMatrix()));
             if (!server && node.mesh) {
                 entity.add<comp::Mesh>(getMesh(gltfFile, *node.mesh));
             }
@@ -321,9 +327,25 @@ GltfFile::~GltfFile()
 
 void GltfFile::instantiate(ecs::World& world, bool server) const
 {
+    // Create all entities at once with the most common components, so their pools only grow once
+    // and the entities don't move through an archetype for every component
+    const auto nodeCount = gltfFile.nodes.size();
+    const auto first
+        = world.createEntities<comp::Name, comp::Transform, comp::Hierarchy>(nodeCount);
+    importCache->entities.resize(nodeCount);
+    importCache->entityInitialized.assign(nodeCount, false);
+    for (size_t i = 0; i < nodeCount; ++i)
+        importCache->entities[i] = world.getEntityHandle(static_cast<ecs::EntityId>(first + i));
+
     for (const auto nodeIndex : gltfFile.scenes[0].nodes) {
         importCache->getEntity(world, gltfFile, nodeIndex, server);
     }
+
+    // Nodes that are not reachable from the scene
+    for (size_t i = 0; i < nodeCount; ++i) {
+        if (!importCache->entityInitialized[i])
+            importCache->entities[i].destroy();
+    }
 }
 
 std::shared_ptr<Mesh> GltfFile::getMesh(const std::string& name) const
@@ -330,17 +330,6 @@ glw::ShaderProgram& getShader()
     static glw::ShaderProgram shader = glwx::makeShaderProgram(vert, frag).value();
     return shader;
 }
-
-glm::mat4 getModelMatrix(ecs::EntityHandle entity, const comp::Transform& transform)
-{
-    if (entity.has<comp::Hierarchy>()) {
-        auto parent = entity.get<comp::Hierarchy>().parent;
-        if (parent && parent.has<comp::Transform>()) {
-            return parent.get<comp::Transform>().getMatrix() * transform.getMatrix();
-        }
-    }
-    return transform.getMatrix();
-}
 }
 
 void resetRenderStats()
@@ -366,9 +355,9 @@ void renderTerminalScreens(ecs::World& world, const glm::vec3& cameraPosition,
 
     const auto size = atlas.size;
     drawImgui(size.x, size.y, [&world, &cameraPosition, &termData, &terminalInUse, &atlas]() {
-        world.forEachEntity<comp::Transform, comp::TerminalScreen>(
+        world.forEachEntity<const comp::WorldTransform, const comp::TerminalScreen>(
             [&cameraPosition, &termData, &terminalInUse, &atlas](
-                const comp::Transform& transform, const comp::TerminalScreen& screen) {
+                const comp::WorldTransform& transform, const comp::TerminalScreen& screen) {
                 if (glm::abs(transform.getPosition().y - cameraPosition.y) > floorHeight / 2.0f) {
                     return;
                 }
@@ -456,13 +445,13 @@ void renderSystem(ecs::World& world, const Frustum& frustum, const glwx::Transfo
     const auto tintLerp = std::cos(std::exp(-lerpedPower) * glm::pi<float>() * 11.0f) * 0.5f + 0.5f;
     const auto lightTint = glm::mix(lightsOffColor, glm::vec3(1.0f), tintLerp);
 
-    world.forEachEntity<const comp::Transform, const comp::Mesh>(
-        [&frustum, &shipState, &view, &shader, glowAmount, lightTint](
-            ecs::EntityHandle entity, const comp::Transform& transform, const comp::Mesh& mesh) {
+    world.forEachEntity<const comp::WorldTransform, const comp::Mesh>(
+        [&frustum, &shipState, &view, &shader, glowAmount, lightTint](ecs::EntityHandle entity,
+            const comp::WorldTransform& transform, const comp::Mesh& mesh) {
             if (entity.has<comp::TerminalScreen>())
                 return;
 
-            const auto model = getModelMatrix(entity, transform);
+            const auto& model = transform.matrix;
             shader.setUniform("modelMatrix", model);
             const auto modelView = view * model;
 
@@ -513,15 +502,15 @@ void renderSystem(ecs::World& world, const Frustum& frustum, const glwx::Transfo
     terminalShader.setUniform("baseColorTexture", 0);
     terminalShader.setUniform("texCoordScale", atlas.getTextureScale());
 
-    world.forEachEntity<comp::Transform, comp::Mesh, comp::TerminalScreen>(
-        [&frustum, &view, &atlas](ecs::EntityHandle entity, comp::Transform& transform,
-            const comp::Mesh& mesh, const comp::TerminalScreen& screen) {
+    world.forEachEntity<const comp::WorldTransform, const comp::Mesh, const comp::TerminalScreen>(
+        [&frustum, &view, &atlas](const comp::WorldTransform& transform, const comp::Mesh& mesh,
+            const comp::TerminalScreen& screen) {
             if (!atlas.textureOffsets.count(screen.system)) {
                 // It was culled
                 return;
             }
 
-            const auto model = getModelMatrix(entity, transform);
+            const auto& model = transform.matrix;
             terminalShader.setUniform("modelMatrix", model);
 
             terminalShader.setUniform("texCoordOffset", atlas.getTextureOffset(screen.system));
@@ -615,10 +604,9 @@ void cullingRenderSystem(
     shader.setUniform("ambientBlend", 0.2f);
     shader.setUniform("glowAmount", 0.0f);
 
-    world.forEachEntity<const comp::Transform, const comp::Mesh>(
-        [&frustum, &view, &shader](
-            ecs::EntityHandle entity, const comp::Transform& transform, const comp::Mesh& mesh) {
-            const auto objModel = getModelMatrix(entity, transform);
+    world.forEachEntity<const comp::WorldTransform, const comp::Mesh>(
+        [&frustum, &view, &shader](const comp::WorldTransform& transform, const comp::Mesh& mesh) {
+            const auto& objModel = transform.matrix;
             const auto objPos = objModel * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
             const auto modelScale = std::max(
                 { glm::length(objModel[0]), glm::length(objModel[1]), glm::length(objModel[2]) });
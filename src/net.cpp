@@ -1,33 +1,60 @@
 #include "net.hpp"
 
+#include <algorithm>
+#include <utility>
+
+namespace {
+template <MessageType MsgType>
+size_t measureMaxSize()
+{
+    // Value-initialized, so conditional fields are measured with their default
+    Message<MsgType> message {};
+    MaxSizeStream stream;
+    stream.serialize(message);
+    return stream.getMaxSize();
+}
+
+template <size_t... Indices>
+std::array<size_t, MessageTypeCount> measureMaxSizes(std::index_sequence<Indices...>)
+{
+    return { measureMaxSize<static_cast<MessageType>(Indices)>()... };
+}
+}
+
+size_t getMaxMessageSize(MessageType messageType)
+{
+    static const auto maxSizes = measureMaxSizes(std::make_index_sequence<MessageTypeCount>());
+    assert(static_cast<size_t>(messageType) < maxSizes.size());
+    return maxSizes[static_cast<size_t>(messageType)];
+}
+
 std::string asString(MessageType messageType)
 {
-    switch (messageType) {
-    case MessageType::ServerHello:
-        return "ServerHello";
-    case MessageType::ClientMoveUpdate:
-        return "ClientMoveUpdate";
-    case MessageType::ServerPlayerStateUpdate:
-        return "ServerPlayerStateUpdate";
-    case MessageType::ClientInteractTerminal:
-        return "ClientInteractTerminal";
-    case MessageType::ServerInteractTerminal:
-        return "ServerInteractTerminal";
-    case MessageType::ClientUpdateTerminalInput:
-        return "ClientUpdateTerminalInput";
-    case MessageType::ClientExecuteCommand:
-        return "ClientExecuteCommand";
-    case MessageType::ServerUpdateTerminalOutput:
-        return "ServerUpdateTerminalOutput";
-    case MessageType::ServerAddTerminalHistory:
-        return "ServerAddTerminalHistory";
-    case MessageType::ClientPlaySound:
-        return "ClientPlaySound";
-    case MessageType::ServerUpdateInputEnabled:
-        return "ServerUpdateInputEnabled";
-    default:
+    if (static_cast<size_t>(messageType) >= MessageTypeCount)
         return fmt::format("Unknown({})", static_cast<uint8_t>(messageType));
+    return messageNames[static_cast<size_t>(messageType)];
+}
+
+bool isInNetPositionBounds(const glm::vec3& position)
+{
+    for (int i = 0; i < 3; ++i) {
+        if (position[i] < netPositionMin[i] || position[i] > netPositionMax[i])
+            return false;
+    }
+    return true;
+}
+
+glm::vec3 clampNetPosition(const glm::vec3& position, bool& outside)
+{
+    if (isInNetPositionBounds(position)) {
+        outside = false;
+        return position;
     }
+    if (!outside)
+        printErr("Position ({}, {}, {}) is outside of the network bounds and will be clamped",
+            position.x, position.y, position.z);
+    outside = true;
+    return glm::clamp(position, netPositionMin, netPositionMax);
 }
 
 uint32_t getChannelFlags(Channel channel)
@@ -41,3 +68,229 @@ uint32_t getChannelFlags(Channel channel)
         std::abort();
     }
 }
+
+PacketBufferPool::Buffer PacketBufferPool::acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.empty())
+        return std::make_unique<WriteBuffer>(InitialCapacity);
+    auto buffer = std::move(buffers_.back());
+    buffers_.pop_back();
+    return buffer;
+}
+
+void PacketBufferPool::release(Buffer buffer)
+{
+    buffer->clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.size() < MaxRetainedBuffers)
+        buffers_.push_back(std::move(buffer));
+}
+
+enet::Packet createPacket(PacketBufferPool::Buffer buffer, uint32_t flags)
+{
+    const auto packet = enet_packet_create(
+        buffer->getData(), buffer->getSize(), flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+    if (!packet)
+        return enet::Packet(nullptr);
+    packet->userData = buffer.release();
+    packet->freeCallback = [](ENetPacket* packet) {
+        PacketBufferPool::instance().release(
+            PacketBufferPool::Buffer(static_cast<WriteBuffer*>(packet->userData)));
+    };
+    return enet::Packet(packet);
+}
+
+void PlayerStateHistory::add(uint32_t frame, const PlayerStateList& players)
+{
+    assert(frame != InvalidFrame);
+    auto& entry = entries_[frame % Size];
+    entry.frame = frame;
+    entry.players = players;
+}
+
+const PlayerStateList* PlayerStateHistory::find(uint32_t frame) const
+{
+    if (frame == InvalidFrame)
+        return nullptr;
+    const auto& entry = entries_[frame % Size];
+    return entry.frame == frame ? &entry.players : nullptr;
+}
+
+const PlayerStateList* PlayerStateHistory::findBaseline(
+    uint32_t frame, uint32_t baselineFrame) const
+{
+    if (baselineFrame == InvalidFrame || baselineFrame >= frame || frame - baselineFrame >= Size)
+        return nullptr;
+    return find(baselineFrame);
+}
+
+Message<MessageType::ServerPlayerStateUpdate> makePlayerStateDelta(uint32_t frameNumber,
+    uint32_t baselineFrame, const PlayerStateList* baseline, const PlayerStateList& players)
+{
+    using PlayerState = Message<MessageType::ServerPlayerStateUpdate>::PlayerState;
+    Message<MessageType::ServerPlayerStateUpdate> message;
+    if (!baseline) {
+        message.players = players;
+        return message;
+    }
+
+    assert(baselineFrame != frameNumber);
+    message.baselineAge = frameNumber - baselineFrame;
+    for (const auto& player : players) {
+        const auto it = std::find_if(baseline->begin(), baseline->end(),
+            [&player](const PlayerState& base) { return base.id == player.id; });
+        if (it == baseline->end()) {
+            message.players.push_back(player);
+            continue;
+        }
+
+        // The values are compared before quantization, but equal inputs quantize to the same
+        // value, so the client ends up with what it would have decoded.
+        uint8_t changedFields = 0;
+        if (player.position != it->position)
+            changedFields |= PlayerState::Position;
+        if (player.orientation != it->orientation)
+            changedFields |= PlayerState::Orientation;
+        if (changedFields) {
+            message.players.push_back(player);
+            message.players.back().changedFields = changedFields;
+        }
+    }
+
+    for (const auto& base : *baseline) {
+        const auto it = std::find_if(players.begin(), players.end(),
+            [&base](const PlayerState& player) { return player.id == base.id; });
+        if (it == players.end())
+            message.removedPlayers.push_back(base.id);
+    }
+    return message;
+}
+
+bool applyPlayerStateDelta(const PlayerStateList* baseline,
+    const Message<MessageType::ServerPlayerStateUpdate>& message, PlayerStateList& players)
+{
+    using PlayerState = Message<MessageType::ServerPlayerStateUpdate>::PlayerState;
+    players.clear();
+    if (message.baselineAge > 0) {
+        if (!baseline)
+            return false;
+        for (const auto& base : *baseline) {
+            const auto& removed = message.removedPlayers;
+            if (std::find(removed.begin(), removed.end(), base.id) == removed.end())
+                players.push_back(base);
+        }
+    }
+
+    for (const auto& update : message.players) {
+        const auto it = std::find_if(players.begin(), players.end(),
+            [&update](const PlayerState& player) { return player.id == update.id; });
+        if (it == players.end()) {
+            if (update.changedFields != PlayerState::AllFields)
+                return false;
+            players.push_back(update);
+        } else {
+            if (update.changedFields & PlayerState::Position)
+                it->position = update.position;
+            if (update.changedFields & PlayerState::Orientation)
+                it->orientation = update.orientation;
+        }
+    }
+    return true;
+}
+
+const PlayerStateList* PlayerStateReceiver::receive(
+    uint32_t frameNumber, const Message<MessageType::ServerPlayerStateUpdate>& message)
+{
+    // Updates are sent unreliably, so they might arrive out of order
+    if (lastFrame_ != InvalidFrame && frameNumber <= lastFrame_)
+        return nullptr;
+
+    PlayerStateList players;
+    const auto baseline = history_.find(message.getBaselineFrame(frameNumber));
+    if (!applyPlayerStateDelta(baseline, message, players)) {
+        ackedFrame_ = InvalidFrame;
+        return nullptr;
+    }
+    history_.add(frameNumber, players);
+    lastFrame_ = frameNumber;
+    ackedFrame_ = frameNumber;
+    return history_.find(frameNumber);
+}
+
+uint8_t PlayerStateReceiver::getAckedSlot() const
+{
+    return Message<MessageType::ClientMoveUpdate>::getAckedSlot(ackedFrame_);
+}
+
+WriteBuffer& getMessageDataBuffer()
+{
+    thread_local WriteBuffer buffer(PacketBufferPool::InitialCapacity);
+    return buffer;
+}
+
+void appendMessage(WriteBuffer& packet, MessageType messageType, const WriteBuffer& data)
+{
+    MessageHeader header { static_cast<uint8_t>(messageType),
+        static_cast<uint32_t>(data.getSize()) };
+    if (!serialize(packet, header)) {
+        assert(false);
+    }
+    packet.write(data.getData(), data.getSize());
+}
+
+MessageQueue::MessageQueue(ENetPeer* peer)
+    : peer_(peer)
+{
+}
+
+bool MessageQueue::add(
+    Channel channel, uint32_t frameNumber, MessageType messageType, const WriteBuffer& data)
+{
+    auto& batch = batches_[static_cast<size_t>(channel)];
+    // The message header has at most 6 bytes
+    const auto messageSize = 6 + data.getSize();
+    bool res = true;
+    if (batch.buffer
+        && (batch.frameNumber != frameNumber
+            || batch.buffer->getSize() + messageSize > MaxPacketSize))
+        res = flush(channel);
+
+    if (!batch.buffer) {
+        batch.buffer = PacketBufferPool::instance().acquire();
+        batch.frameNumber = frameNumber;
+        PacketHeader header { frameNumber };
+        if (!serialize(*batch.buffer, header)) {
+            assert(false);
+        }
+    }
+    appendMessage(*batch.buffer, messageType, data);
+    return res;
+}
+
+bool MessageQueue::flush()
+{
+    bool res = true;
+    for (size_t i = 0; i < batches_.size(); ++i)
+        res = flush(static_cast<Channel>(i)) && res;
+    return res;
+}
+
+bool MessageQueue::flush(Channel channel)
+{
+    auto& batch = batches_[static_cast<size_t>(channel)];
+    if (!batch.buffer)
+        return true;
+    auto packet = createPacket(std::move(batch.buffer), getChannelFlags(channel));
+    if (!packet.get()) {
+        printErr("Could not create packet");
+        return false;
+    }
+    if (enet_peer_send(peer_, static_cast<uint8_t>(channel), packet.get()) < 0) {
+        printErr("Error sending packet");
+        return false;
+    }
+    // ENet owns the packet now
+    packet.release();
+    return true;
+}
@@ -1,21 +1,43 @@
 #pragma once
 
+#include <array>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <utility>
 
 #include <fmt/format.h>
 
 #include "enet.hpp"
 #include "serialization.hpp"
-#include "shipsystem.hpp"
+#include "singleton.hpp"
 #include "util.hpp"
 #include "version.hpp"
 
 static constexpr size_t maxPlayers = 4;
 static constexpr size_t tickRate = 60;
 
+// Positions in player state messages are quantized within these bounds. They are the bounds of the
+// colliders in media/ship.glb, (-44.5, -12.0, -53.7) to (20.1, 15.0, 64.9), with a few meters of
+// margin and room to jump on top. The server checks them against the map when it is loaded.
+static const glm::vec3 netPositionMin(-48.0f, -16.0f, -64.0f);
+static const glm::vec3 netPositionMax(24.0f, 24.0f, 72.0f);
+static constexpr float netPositionPrecision = 0.001f;
+
+bool isInNetPositionBounds(const glm::vec3& position);
+
+// Positions outside of the bounds would be clamped silently by the serialization, so this clamps
+// them and logs it once, until the position is inside the bounds again (tracked in `outside`).
+glm::vec3 clampNetPosition(const glm::vec3& position, bool& outside);
+
 using PlayerId = uint32_t;
 static constexpr auto InvalidPlayerId = std::numeric_limits<PlayerId>::max();
 
+static constexpr auto InvalidFrame = std::numeric_limits<uint32_t>::max();
+
+// Number of frames the player states are kept for to encode and decode deltas against them
+static constexpr uint32_t playerStateHistorySize = 32;
+
 struct HostPort {
     std::string host;
     Port port;
@@ -29,18 +51,30 @@ enum class Channel : uint8_t {
 
 uint32_t getChannelFlags(Channel channel);
 
-struct CommonMessageHeader {
-    uint8_t messageType;
+// A packet contains one or more messages (see MessageQueue). Every message is a MessageHeader
+// followed by size bytes of message data.
+struct PacketHeader {
     uint32_t frameNumber; // will not wrap in 130 years (60 fps)
 
     SERIALIZE()
     {
-        FIELD(messageType);
         FIELD(frameNumber);
         SERIALIZE_END;
     }
 };
 
+struct MessageHeader {
+    uint8_t messageType;
+    uint32_t size;
+
+    SERIALIZE()
+    {
+        FIELD(messageType);
+        FIELD_VARINT(size);
+        SERIALIZE_END;
+    }
+};
+
 enum class MessageType : uint8_t {
     ServerHello = 0,
     ClientMoveUpdate,
@@ -54,22 +88,35 @@ enum class MessageType : uint8_t {
     ClientPlaySound,
     ServerUpdateInputEnabled,
     ServerUpdateShipState,
+    Count,
 };
 
+static constexpr auto MessageTypeCount = static_cast<size_t>(MessageType::Count);
+
 std::string asString(MessageType messageType);
 
+// Every Message specialization has to contain this
+#define MESSAGE_TRAITS(type, channel)                                                              \
+    static constexpr const char* Name = #type;                                                     \
+    static constexpr Channel AllowedChannel = Channel::channel
+
+// Strings are received as views into the packet data, so they are parsed without allocating. Copy
+// them if they need to outlive the message handler. When sending, they must outlive the
+// serialization of the message.
 template <MessageType MsgType>
 struct Message;
 
 template <>
 struct Message<MessageType::ServerHello> {
+    MESSAGE_TRAITS(ServerHello, Reliable);
+
     uint32_t playerId;
     glm::vec3 spawnPosition;
     glm::quat spawnOrientation;
 
     SERIALIZE()
     {
-        FIELD(playerId);
+        FIELD_VARINT(playerId);
         FIELD(spawnPosition);
         FIELD(spawnOrientation);
         SERIALIZE_END;
@@ -78,45 +125,103 @@ struct Message<MessageType::ServerHello> {
 
 template <>
 struct Message<MessageType::ClientMoveUpdate> {
+    MESSAGE_TRAITS(ClientMoveUpdate, Unreliable);
+
     glm::vec3 position;
     glm::quat orientation;
+    // Frame of the newest ServerPlayerStateUpdate the client has received modulo
+    // playerStateHistorySize, because the server can not use older frames anyway.
+    // playerStateHistorySize if there is none. The frame numbers of the client are unrelated to the
+    // ones of the server, so this can't be an age relative to the packet like baselineAge.
+    uint8_t ackedPlayerStateSlot = playerStateHistorySize;
 
     SERIALIZE()
     {
-        FIELD(position);
-        FIELD(orientation);
+        FIELD_QFLOAT(position, netPositionMin, netPositionMax, netPositionPrecision);
+        FIELD_QUAT(orientation);
+        FIELD_RANGED(ackedPlayerStateSlot, 0, playerStateHistorySize);
         SERIALIZE_END;
     }
+
+    static uint8_t getAckedSlot(uint32_t ackedFrame)
+    {
+        if (ackedFrame == InvalidFrame)
+            return playerStateHistorySize;
+        return static_cast<uint8_t>(ackedFrame % playerStateHistorySize);
+    }
+
+    // The newest frame before currentFrame in the slot. InvalidFrame if there is none. If the
+    // client acknowledged an older frame, this is a frame it did not receive, so it will not find
+    // the baseline and acknowledge nothing until it gets a full update (see PlayerStateReceiver).
+    uint32_t getAckedFrame(uint32_t currentFrame) const
+    {
+        if (ackedPlayerStateSlot >= playerStateHistorySize || currentFrame == 0)
+            return InvalidFrame;
+        // Unsigned overflow is fine, because 2^32 is a multiple of playerStateHistorySize
+        const auto age = (currentFrame - 1 - ackedPlayerStateSlot) % playerStateHistorySize;
+        return age < currentFrame ? currentFrame - 1 - age : InvalidFrame;
+    }
 };
 
+// Encoded relative to the state of a frame the client has acknowledged (see
+// makePlayerStateDelta).
 template <>
 struct Message<MessageType::ServerPlayerStateUpdate> {
+    MESSAGE_TRAITS(ServerPlayerStateUpdate, Unreliable);
+
     struct PlayerState {
+        enum Fields : uint8_t {
+            Position = 1 << 0,
+            Orientation = 1 << 1,
+            AllFields = Position | Orientation,
+        };
+
         uint32_t id;
         glm::vec3 position;
         glm::quat orientation;
+        // Only these fields are serialized
+        uint8_t changedFields = AllFields;
 
         SERIALIZE()
         {
-            FIELD(id);
-            FIELD(position);
-            FIELD(orientation);
+            FIELD_VARINT(id);
+            FIELD_RANGED(changedFields, 0, AllFields);
+            if (changedFields & Position)
+                FIELD_QFLOAT(position, netPositionMin, netPositionMax, netPositionPrecision);
+            if (changedFields & Orientation)
+                FIELD_QUAT(orientation);
             SERIALIZE_END;
         }
     };
 
+    // Number of frames since the baseline, so it usually fits in a byte. 0 if all players are
+    // sent with all fields.
+    uint32_t baselineAge = 0;
+    // Players in the baseline that are gone
+    std::vector<PlayerId> removedPlayers;
+    // Players that are not in the baseline or changed since
     std::vector<PlayerState> players;
 
     SERIALIZE()
     {
+        FIELD_VARINT(baselineAge);
+        FIELD_VEC(removedPlayers);
         FIELD_VEC(players);
         SERIALIZE_END;
     }
+
+    // InvalidFrame if there is no baseline
+    uint32_t getBaselineFrame(uint32_t frameNumber) const
+    {
+        return baselineAge > 0 ? frameNumber - baselineAge : InvalidFrame;
+    }
 };
 
 template <>
 struct Message<MessageType::ClientInteractTerminal> {
-    std::string terminal;
+    MESSAGE_TRAITS(ClientInteractTerminal, Reliable);
+
+    std::string_view terminal;
 
     SERIALIZE()
     {
@@ -127,7 +232,9 @@ struct Message<MessageType::ClientInteractTerminal> {
 
 template <>
 struct Message<MessageType::ServerInteractTerminal> {
-    std::string terminal;
+    MESSAGE_TRAITS(ServerInteractTerminal, Reliable);
+
+    std::string_view terminal;
     PlayerId user;
 
     SERIALIZE()
@@ -140,7 +247,9 @@ struct Message<MessageType::ServerInteractTerminal> {
 
 template <>
 struct Message<MessageType::ClientUpdateTerminalInput> {
-    std::string input;
+    MESSAGE_TRAITS(ClientUpdateTerminalInput, Reliable);
+
+    std::string_view input;
 
     SERIALIZE()
     {
@@ -151,7 +260,9 @@ struct Message<MessageType::ClientUpdateTerminalInput> {
 
 template <>
 struct Message<MessageType::ClientExecuteCommand> {
-    std::string command;
+    MESSAGE_TRAITS(ClientExecuteCommand, Reliable);
+
+    std::string_view command;
 
     SERIALIZE()
     {
@@ -162,8 +273,10 @@ struct Message<MessageType::ClientExecuteCommand> {
 
 template <>
 struct Message<MessageType::ServerUpdateTerminalOutput> {
-    std::string terminal;
-    std::string text;
+    MESSAGE_TRAITS(ServerUpdateTerminalOutput, Reliable);
+
+    std::string_view terminal;
+    std::string_view text;
 
     SERIALIZE()
     {
@@ -175,8 +288,10 @@ struct Message<MessageType::ServerUpdateTerminalOutput> {
 
 template <>
 struct Message<MessageType::ServerAddTerminalHistory> {
-    std::string terminal;
-    std::vector<std::string> commands;
+    MESSAGE_TRAITS(ServerAddTerminalHistory, Reliable);
+
+    std::string_view terminal;
+    std::vector<std::string_view> commands;
 
     SERIALIZE()
     {
@@ -188,7 +303,9 @@ struct Message<MessageType::ServerAddTerminalHistory> {
 
 template <>
 struct Message<MessageType::ClientPlaySound> {
-    std::string name;
+    MESSAGE_TRAITS(ClientPlaySound, Reliable);
+
+    std::string_view name;
     glm::vec3 position;
 
     SERIALIZE()
@@ -201,7 +318,9 @@ struct Message<MessageType::ClientPlaySound> {
 
 template <>
 struct Message<MessageType::ServerUpdateInputEnabled> {
-    std::string terminal;
+    MESSAGE_TRAITS(ServerUpdateInputEnabled, Reliable);
+
+    std::string_view terminal;
     bool enabled;
 
     SERIALIZE()
@@ -214,50 +333,246 @@ struct Message<MessageType::ServerUpdateInputEnabled> {
 
 template <>
 struct Message<MessageType::ServerUpdateShipState> {
+    MESSAGE_TRAITS(ServerUpdateShipState, Reliable);
+
     float engineThrottle;
     float reactorPower;
 
     SERIALIZE()
     {
-        FIELD(engineThrottle);
-        FIELD(reactorPower);
+        FIELD_QFLOAT(engineThrottle, 0.0f, 1.0f, 0.001f);
+        FIELD_QFLOAT(reactorPower, 0.0f, 1.0f, 0.001f);
         SERIALIZE_END;
     }
 };
 
-template <MessageType MsgType>
-WriteBuffer serializeMessage(uint32_t frameNumber, Message<MsgType> message)
+// Generated from the Message specializations, so a message type can not be missing
+template <size_t... Indices>
+constexpr std::array<const char*, MessageTypeCount> makeMessageNames(
+    std::index_sequence<Indices...>)
 {
-    WriteBuffer buffer(1024);
-    CommonMessageHeader header { static_cast<uint8_t>(MsgType), frameNumber };
-    if (!serialize(buffer, header)) {
-        assert(false);
+    return { Message<static_cast<MessageType>(Indices)>::Name... };
+}
+
+template <size_t... Indices>
+constexpr std::array<Channel, MessageTypeCount> makeMessageChannels(
+    std::index_sequence<Indices...>)
+{
+    return { Message<static_cast<MessageType>(Indices)>::AllowedChannel... };
+}
+
+// Indexed by MessageType
+static constexpr auto messageNames = makeMessageNames(std::make_index_sequence<MessageTypeCount>());
+static constexpr auto messageChannels
+    = makeMessageChannels(std::make_index_sequence<MessageTypeCount>());
+
+// Upper bound for the serialized size without header. 0 if it has strings or vectors. Measured by
+// serializing every message type once, on the first call.
+size_t getMaxMessageSize(MessageType messageType);
+
+// Indexed by MessageType, nullptr for messages that are not handled
+template <typename Handler>
+using MessageHandlerTable = std::array<Handler, MessageTypeCount>;
+
+// Returns nullptr and prints an error if the message is not handled, was sent on the wrong
+// channel or is larger than its maximum size.
+template <typename Handler>
+Handler findMessageHandler(const MessageHandlerTable<Handler>& handlers, MessageType messageType,
+    uint8_t channelId, size_t size)
+{
+    const auto index = static_cast<size_t>(messageType);
+    if (index >= handlers.size() || !handlers[index]) {
+        printErr("Received unexpected message: {}", asString(messageType));
+        return nullptr;
+    }
+    if (channelId != static_cast<uint8_t>(messageChannels[index])) {
+        printErr("Received {} on wrong channel {}", messageNames[index], channelId);
+        return nullptr;
     }
-    if (!serialize(buffer, message)) {
+    const auto maxSize = getMaxMessageSize(messageType);
+    if (maxSize > 0 && size > maxSize) {
+        printErr("Received {} of size {} (max: {})", messageNames[index], size, maxSize);
+        return nullptr;
+    }
+    return handlers[index];
+}
+
+using PlayerStateList = std::vector<Message<MessageType::ServerPlayerStateUpdate>::PlayerState>;
+
+// The player states of the last few frames, so the server can encode updates relative to the
+// newest one a client has acknowledged and the client can decode them.
+class PlayerStateHistory {
+public:
+    static constexpr size_t Size = playerStateHistorySize;
+
+    void add(uint32_t frame, const PlayerStateList& players);
+
+    // nullptr if frame is too old or was never added
+    const PlayerStateList* find(uint32_t frame) const;
+
+    // Like find, but also nullptr unless baselineFrame is before frame and within Size frames of
+    // it, so a delta from it to frame has a valid age. For frames acknowledged by clients.
+    const PlayerStateList* findBaseline(uint32_t frame, uint32_t baselineFrame) const;
+
+private:
+    struct Entry {
+        uint32_t frame = InvalidFrame;
+        PlayerStateList players;
+    };
+
+    std::array<Entry, Size> entries_;
+};
+
+// Leaves out players whose state is the same as in baseline and fields that did not change. If
+// baseline is nullptr, all players are included with all fields.
+Message<MessageType::ServerPlayerStateUpdate> makePlayerStateDelta(uint32_t frameNumber,
+    uint32_t baselineFrame, const PlayerStateList* baseline, const PlayerStateList& players);
+
+// Returns false if the message needs a baseline, but baseline is nullptr, or it is inconsistent
+// with the baseline.
+bool applyPlayerStateDelta(const PlayerStateList* baseline,
+    const Message<MessageType::ServerPlayerStateUpdate>& message, PlayerStateList& players);
+
+// The client side of the deltas: Decodes player state updates and keeps track of the frame to
+// acknowledge.
+class PlayerStateReceiver {
+public:
+    // nullptr if the update is older than the last one or its baseline is missing. The latter
+    // happens if more than playerStateHistorySize updates in a row were lost, because the server
+    // then resolves the acknowledged slot to a frame that never arrived. Nothing is acknowledged
+    // until the next update is decoded, so the server sends all players with all fields.
+    const PlayerStateList* receive(
+        uint32_t frameNumber, const Message<MessageType::ServerPlayerStateUpdate>& message);
+
+    uint8_t getAckedSlot() const;
+
+private:
+    PlayerStateHistory history_;
+    uint32_t lastFrame_ = InvalidFrame;
+    uint32_t ackedFrame_ = InvalidFrame;
+};
+
+// Recycles the buffers messages are serialized into. createPacket hands a buffer to ENet without
+// copying it (ENET_PACKET_FLAG_NO_ALLOCATE) and it is returned when ENet destroys the packet, so
+// once enough buffers are pooled, only ENet's own small packet struct is allocated per message.
+// Client and server share it in solo mode, so it is thread-safe.
+class PacketBufferPool : public Singleton<PacketBufferPool> {
+public:
+    using Buffer = std::unique_ptr<WriteBuffer>;
+
+    static constexpr size_t InitialCapacity = 1024;
+    static constexpr size_t MaxRetainedBuffers = 256;
+
+    // Empty, but with the capacity of its previous use
+    Buffer acquire();
+    void release(Buffer buffer);
+
+private:
+    friend class Singleton<PacketBufferPool>;
+
+    PacketBufferPool() = default;
+
+    std::mutex mutex_;
+    std::vector<Buffer> buffers_;
+};
+
+// The packet points to the data in buffer and returns it to the pool when it is destroyed
+enet::Packet createPacket(PacketBufferPool::Buffer buffer, uint32_t flags);
+
+// Reused for every message serialized on the calling thread
+WriteBuffer& getMessageDataBuffer();
+
+// The message data of the last call is reused by the next call on the same thread
+template <MessageType MsgType>
+const WriteBuffer& serializeMessageData(Message<MsgType> message)
+{
+    auto& buffer = getMessageDataBuffer();
+    buffer.clear();
+    if (!serialize<BitWriteStream>(buffer, message)) {
         assert(false);
     }
     return buffer;
 }
 
+// Appends the MessageHeader and the data
+void appendMessage(WriteBuffer& packet, MessageType messageType, const WriteBuffer& data);
+
+// A packet containing only this message
 template <MessageType MsgType>
-bool sendMessage(
-    ENetPeer* peer, Channel channel, uint32_t frameNumber, const Message<MsgType>& message)
+PacketBufferPool::Buffer serializeMessage(uint32_t frameNumber, Message<MsgType> message)
 {
-    const auto buffer = serializeMessage(frameNumber, message);
-    const auto packet
-        = enet_packet_create(buffer.getData(), buffer.getSize(), getChannelFlags(channel));
-    if (!packet) {
-        printErr("Could not create packet");
-        return false;
+    const auto& data = serializeMessageData(message);
+    auto buffer = PacketBufferPool::instance().acquire();
+    buffer->fit(sizeof(PacketHeader) + sizeof(MessageHeader) + data.getSize());
+    PacketHeader header { frameNumber };
+    if (!serialize(*buffer, header)) {
+        assert(false);
     }
-    const auto res = enet_peer_send(peer, static_cast<uint8_t>(channel), packet);
-    if (res < 0) {
-        printErr("Error sending message of type {}", MsgType);
+    appendMessage(*buffer, MsgType, data);
+    return buffer;
+}
+
+// Calls func(uint32_t frameNumber, MessageType messageType, ReadBuffer& data) for every message
+// in a packet. Returns false if the packet is malformed, after calling func for the messages
+// before the error.
+template <typename Func>
+bool forEachMessage(const uint8_t* packetData, size_t packetSize, Func&& func)
+{
+    ReadBuffer buffer(packetData, packetSize);
+    PacketHeader packetHeader;
+    if (!deserialize(buffer, packetHeader))
         return false;
-    }
+    do {
+        MessageHeader header;
+        if (!deserialize(buffer, header))
+            return false;
+        const auto data = buffer.readView(header.size);
+        if (!data)
+            return false;
+        ReadBuffer messageBuffer(data, header.size);
+        func(packetHeader.frameNumber, static_cast<MessageType>(header.messageType), messageBuffer);
+    } while (buffer.getLeft() > 0);
     return true;
 }
 
+// Collects the messages sent to a peer, so every channel sends a single packet per flush instead
+// of one per message, which saves ENet's per packet headers and commands. Messages are in the
+// order they were added.
+class MessageQueue {
+public:
+    // ENet's default MTU is 1400 and packets that fit are not fragmented. A message that is
+    // larger by itself gets a packet of its own.
+    static constexpr size_t MaxPacketSize = 1200;
+
+    MessageQueue(ENetPeer* peer = nullptr);
+
+    template <MessageType MsgType>
+    bool add(Channel channel, uint32_t frameNumber, const Message<MsgType>& message)
+    {
+        assert(channel == Message<MsgType>::AllowedChannel);
+        return add(channel, frameNumber, MsgType, serializeMessageData(message));
+    }
+
+    // data is the output of serializeMessageData, so a message that is sent to several peers only
+    // needs to be serialized once
+    bool add(Channel channel, uint32_t frameNumber, MessageType messageType,
+        const WriteBuffer& data);
+
+    // Sends the pending packet of every channel
+    bool flush();
+
+private:
+    struct Batch {
+        PacketBufferPool::Buffer buffer;
+        uint32_t frameNumber = InvalidFrame;
+    };
+
+    bool flush(Channel channel);
+
+    ENetPeer* peer_;
+    std::array<Batch, static_cast<size_t>(Channel::Count)> batches_;
+};
+
 constexpr uint32_t getConnectCode(uint32_t gameCode)
 {
     return gameCode << 24 | version;
@@ -106,8 +106,9 @@ std::optional<RayCastHit> castRay(
     ecs::World& world, const glm::vec3& rayOrigin, const glm::vec3& rayDir)
 {
     std::optional<RayCastHit> hit;
-    world.forEachEntity<const comp::Transform, const comp::BoxCollider>(
-        [&](ecs::EntityHandle entity, const comp::Transform& trafo,
+    // Colliders might be parented, so their local Transform is not enough
+    world.forEachEntity<const comp::WorldTransform, const comp::BoxCollider>(
+        [&](ecs::EntityHandle entity, const comp::WorldTransform& trafo,
             const comp::BoxCollider& collider) {
             const auto aabb = glwx::Aabb {
                 trafo.getPosition() - collider.halfExtents,
@@ -152,6 +153,75 @@ void integrationSystem(ecs::World& world, float dt)
         });
 }
 
+namespace {
+ecs::EntityHandle getParent(ecs::EntityHandle entity)
+{
+    const auto hierarchy = entity.getPtr<const comp::Hierarchy>();
+    return hierarchy ? hierarchy->parent : ecs::EntityHandle();
+}
+
+glm::mat4 getParentMatrix(ecs::EntityHandle entity)
+{
+    auto parent = getParent(entity);
+    if (!parent)
+        return glm::mat4(1.0f);
+    if (const auto worldTransform = parent.getPtr<const comp::WorldTransform>())
+        return worldTransform->matrix;
+    return getParentMatrix(parent);
+}
+
+bool isDirty(ecs::EntityHandle entity, ecs::Version since)
+{
+    auto& world = *entity.getWorld();
+    const auto id = entity.getId();
+    return (entity.has<comp::Transform>() && world.hasChanged<comp::Transform>(id, since))
+        || (entity.has<comp::Hierarchy>() && world.hasChanged<comp::Hierarchy>(id, since));
+}
+
+// Whether the WorldTransform was written after version, i.e. in the current transformSystem call
+bool isUpdated(ecs::EntityHandle entity, ecs::Version version)
+{
+    return entity.has<comp::WorldTransform>()
+        && entity.getWorld()->hasChanged<comp::WorldTransform>(entity.getId(), version);
+}
+
+void updateSubtree(ecs::EntityHandle entity, const glm::mat4& parentMatrix)
+{
+    auto matrix = parentMatrix;
+    if (const auto transform = entity.getPtr<const comp::Transform>()) {
+        matrix = parentMatrix * transform->getMatrix();
+        entity.getOrAdd<comp::WorldTransform>().matrix = matrix;
+    }
+
+    if (const auto hierarchy = entity.getPtr<const comp::Hierarchy>()) {
+        for (auto child = hierarchy->firstChild; child;
+             child = child.get<const comp::Hierarchy>().nextSibling)
+            updateSubtree(child, matrix);
+    }
+}
+}
+
+ecs::Version transformSystem(ecs::World& world, ecs::Version since)
+{
+    const auto version = world.advanceVersion();
+
+    // Only start at the topmost dirty ancestor, so parents are always updated before their
+    // children. Its WorldTransform is written in this call, which marks the whole subtree as done.
+    const auto update = [since, version](ecs::EntityHandle entity) {
+        auto root = entity;
+        for (auto parent = getParent(entity); parent; parent = getParent(parent)) {
+            if (isDirty(parent, since))
+                root = parent;
+        }
+        if (!isUpdated(root, version))
+            updateSubtree(root, getParentMatrix(root));
+    };
+    world.forEachChanged<const comp::Transform>(since, update);
+    world.forEachChanged<const comp::Hierarchy>(since, update);
+
+    return version;
+}
+
 void comp::PlayerInputController::updateFromOrientation(const comp::Transform& trafo)
 {
     // glm::eulerAngles returns I don't even know what (some total bullshit)
@@ -12,6 +12,17 @@
 namespace comp {
 using Transform = glwx::Transform;
 
+// Transform relative to the world, including all parents in the Hierarchy. Maintained by
+// transformSystem, so it is only up to date after it ran.
+struct WorldTransform {
+    glm::mat4 matrix { 1.0f };
+
+    glm::vec3 getPosition() const
+    {
+        return glm::vec3(matrix[3]);
+    }
+};
+
 struct Velocity {
     glm::vec3 value { 0.0f, 0.0f, 0.0f };
 };
@@ -35,6 +46,8 @@ struct Ladder {
 };
 
 struct PlayerInputController {
+    static constexpr bool SparseStorage = true;
+
     template <typename T>
     PlayerInputController(SDL_Scancode forwards, SDL_Scancode backwards, SDL_Scancode left,
         SDL_Scancode right, SDL_Scancode up, SDL_Scancode down, SDL_Scancode sprint, T&& interact)
@@ -86,10 +99,16 @@ struct RayCastHit {
     float t;
 };
 
+// Tests against the BoxColliders at their WorldTransform, as of the last transformSystem
 std::optional<RayCastHit> castRay(
     ecs::World& world, const glm::vec3& rayOrigin, const glm::vec3& rayDir);
 
 void integrationSystem(ecs::World& world, float dt);
 
+// Updates the WorldTransform of all entities whose Transform or Hierarchy changed after version
+// since and of all their descendants. Entities with a Transform but without WorldTransform get
+// one. Returns the version to pass as since next time.
+ecs::Version transformSystem(ecs::World& world, ecs::Version since);
+
 void playerLookSystem(ecs::World& world, float dt);
 void playerControlSystem(ecs::World& world, float dt);
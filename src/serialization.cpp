@@ -108,9 +108,16 @@ bool WriteStream::serialize(float val)
 }
 
 bool WriteStream::serialize(std::string& str)
+{
+    std::string_view view(str);
+    return serialize(view);
+}
+
+bool WriteStream::serialize(std::string_view& str)
 {
     assert(str.size() <= MaxStringLength);
-    if (!serialize(static_cast<StringLength>(str.size())))
+    auto size = static_cast<StringLength>(str.size());
+    if (!serializeVarint(*this, size))
         return false;
     buffer_.write(str.data(), str.size());
     return true;
@@ -136,12 +143,30 @@ bool WriteStream::serialize(glm::quat& q)
     return serializeFor(q, 4);
 }
 
+bool WriteStream::serializeBits(uint32_t value, size_t bits)
+{
+    assert(bits <= 32 && (bits == 32 || value >> bits == 0));
+    // Big endian, like serializeInt
+    for (size_t byte = (bits + 7) / 8; byte > 0; --byte)
+        buffer_.write(static_cast<uint8_t>(value >> ((byte - 1) * 8)));
+    return true;
+}
+
 ReadBuffer::ReadBuffer(const uint8_t* data, size_t size)
     : data_(data)
     , size_(size)
 {
 }
 
+const uint8_t* ReadBuffer::readView(size_t numBytes)
+{
+    if (!canRead(numBytes))
+        return nullptr;
+    const auto data = data_ + cursor_;
+    cursor_ += numBytes;
+    return data;
+}
+
 size_t ReadBuffer::getCursor() const
 {
     return cursor_;
@@ -210,12 +235,24 @@ bool ReadStream::serialize(float& val)
 }
 
 bool ReadStream::serialize(std::string& str)
+{
+    std::string_view view;
+    if (!serialize(view))
+        return false;
+    str.assign(view);
+    return true;
+}
+
+bool ReadStream::serialize(std::string_view& str)
 {
     StringLength size = 0;
-    if (!serialize(size))
+    if (!serializeVarint(*this, size))
         return false;
-    str.resize(size, 0);
-    return buffer_.read(str.data(), size);
+    const auto data = buffer_.readView(size);
+    if (!data)
+        return false;
+    str = std::string_view(reinterpret_cast<const char*>(data), size);
+    return true;
 }
 
 bool ReadStream::serialize(glm::vec2& v)
@@ -237,3 +274,337 @@ bool ReadStream::serialize(glm::quat& q)
 {
     return serializeFor(q, 4);
 }
+
+bool ReadStream::serializeBits(uint32_t& value, size_t bits)
+{
+    assert(bits <= 32);
+    value = 0;
+    for (size_t byte = 0; byte < (bits + 7) / 8; ++byte) {
+        uint8_t r = 0;
+        if (!buffer_.read(r))
+            return false;
+        value = value << 8 | r;
+    }
+    return true;
+}
+
+BitWriteStream::BitWriteStream(WriteBuffer& buffer)
+    : buffer_(buffer)
+{
+}
+
+BitWriteStream::~BitWriteStream()
+{
+    flush();
+}
+
+bool BitWriteStream::serialize(bool v)
+{
+    return serializeBits(v ? 1 : 0, 1);
+}
+
+bool BitWriteStream::serialize(uint8_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(int8_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(uint16_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(int16_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(uint32_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(int32_t v)
+{
+    return serializeInt(v);
+}
+
+bool BitWriteStream::serialize(float val)
+{
+    static_assert(sizeof(float) == sizeof(uint32_t));
+    uint32_t i = 0;
+    std::memcpy(&i, &val, sizeof(float));
+    return serializeBits(i, 32);
+}
+
+bool BitWriteStream::serialize(std::string& str)
+{
+    std::string_view view(str);
+    return serialize(view);
+}
+
+bool BitWriteStream::serialize(std::string_view& str)
+{
+    assert(str.size() <= MaxStringLength);
+    auto size = static_cast<StringLength>(str.size());
+    if (!serializeVarint(*this, size))
+        return false;
+    flush();
+    buffer_.write(str.data(), str.size());
+    return true;
+}
+
+bool BitWriteStream::serialize(glm::vec2& v)
+{
+    return serializeFor(v, 2);
+}
+
+bool BitWriteStream::serialize(glm::vec3& v)
+{
+    return serializeFor(v, 3);
+}
+
+bool BitWriteStream::serialize(glm::vec4& v)
+{
+    return serializeFor(v, 4);
+}
+
+bool BitWriteStream::serialize(glm::quat& q)
+{
+    return serializeFor(q, 4);
+}
+
+bool BitWriteStream::serializeBits(uint32_t value, size_t bits)
+{
+    assert(bits <= 32 && (bits == 32 || value >> bits == 0));
+    scratch_ |= static_cast<uint64_t>(value) << scratchBits_;
+    scratchBits_ += bits;
+    while (scratchBits_ >= 8) {
+        buffer_.write(static_cast<uint8_t>(scratch_));
+        scratch_ >>= 8;
+        scratchBits_ -= 8;
+    }
+    return true;
+}
+
+void BitWriteStream::flush()
+{
+    if (scratchBits_ > 0) {
+        buffer_.write(static_cast<uint8_t>(scratch_));
+        scratch_ = 0;
+        scratchBits_ = 0;
+    }
+}
+
+BitReadStream::BitReadStream(ReadBuffer& buffer)
+    : buffer_(buffer)
+{
+}
+
+bool BitReadStream::serialize(bool& v)
+{
+    uint32_t i = 0;
+    if (!serializeBits(i, 1))
+        return false;
+    v = i != 0;
+    return true;
+}
+
+bool BitReadStream::serialize(uint8_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(int8_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(uint16_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(int16_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(uint32_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(int32_t& v)
+{
+    return serializeInt(v);
+}
+
+bool BitReadStream::serialize(float& val)
+{
+    uint32_t i = 0;
+    if (!serializeBits(i, 32))
+        return false;
+    std::memcpy(&val, &i, sizeof(float));
+    return true;
+}
+
+bool BitReadStream::serialize(std::string& str)
+{
+    std::string_view view;
+    if (!serialize(view))
+        return false;
+    str.assign(view);
+    return true;
+}
+
+bool BitReadStream::serialize(std::string_view& str)
+{
+    StringLength size = 0;
+    if (!serializeVarint(*this, size))
+        return false;
+    // The writer padded the current byte, which was read completely already
+    assert(scratchBits_ < 8);
+    scratch_ = 0;
+    scratchBits_ = 0;
+    const auto data = buffer_.readView(size);
+    if (!data)
+        return false;
+    str = std::string_view(reinterpret_cast<const char*>(data), size);
+    return true;
+}
+
+bool BitReadStream::serialize(glm::vec2& v)
+{
+    return serializeFor(v, 2);
+}
+
+bool BitReadStream::serialize(glm::vec3& v)
+{
+    return serializeFor(v, 3);
+}
+
+bool BitReadStream::serialize(glm::vec4& v)
+{
+    return serializeFor(v, 4);
+}
+
+bool BitReadStream::serialize(glm::quat& q)
+{
+    return serializeFor(q, 4);
+}
+
+bool BitReadStream::serializeBits(uint32_t& value, size_t bits)
+{
+    assert(bits <= 32);
+    while (scratchBits_ < bits) {
+        uint8_t r = 0;
+        if (!buffer_.read(r))
+            return false;
+        scratch_ |= static_cast<uint64_t>(r) << scratchBits_;
+        scratchBits_ += 8;
+    }
+    value = static_cast<uint32_t>(scratch_ & ((uint64_t(1) << bits) - 1));
+    scratch_ >>= bits;
+    scratchBits_ -= bits;
+    return true;
+}
+
+bool MaxSizeStream::serialize(bool)
+{
+    bits_ += 1;
+    return true;
+}
+
+bool MaxSizeStream::serialize(uint8_t)
+{
+    bits_ += 8;
+    return true;
+}
+
+bool MaxSizeStream::serialize(int8_t)
+{
+    bits_ += 8;
+    return true;
+}
+
+bool MaxSizeStream::serialize(uint16_t)
+{
+    bits_ += 16;
+    return true;
+}
+
+bool MaxSizeStream::serialize(int16_t)
+{
+    bits_ += 16;
+    return true;
+}
+
+bool MaxSizeStream::serialize(uint32_t)
+{
+    bits_ += 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(int32_t)
+{
+    bits_ += 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(float)
+{
+    bits_ += 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(std::string&)
+{
+    bounded_ = false;
+    return true;
+}
+
+bool MaxSizeStream::serialize(std::string_view&)
+{
+    bounded_ = false;
+    return true;
+}
+
+bool MaxSizeStream::serialize(glm::vec2&)
+{
+    bits_ += 2 * 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(glm::vec3&)
+{
+    bits_ += 3 * 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(glm::vec4&)
+{
+    bits_ += 4 * 32;
+    return true;
+}
+
+bool MaxSizeStream::serialize(glm::quat&)
+{
+    bits_ += 4 * 32;
+    return true;
+}
+
+bool MaxSizeStream::serializeBits(uint32_t /*value*/, size_t bits)
+{
+    bits_ += bits;
+    return true;
+}
+
+size_t MaxSizeStream::getMaxSize() const
+{
+    return bounded_ ? (bits_ + 7) / 8 : 0;
+}
@@ -1,5 +1,11 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <glm/glm.hpp>
@@ -9,6 +15,10 @@
 
 enum class StreamType { Read, Write };
 
+// Defined below the streams, which use it for lengths
+template <typename Stream, typename T>
+bool serializeVarint(Stream& stream, T& v);
+
 template <typename T, std::enable_if_t<std::is_integral_v<T>, bool> = true>
 T ntoh(T val)
 {
@@ -103,6 +113,7 @@ public:
     bool serialize(int32_t v);
     bool serialize(float val);
     bool serialize(std::string& str);
+    bool serialize(std::string_view& str);
     bool serialize(glm::vec2& v);
     bool serialize(glm::vec3& v);
     bool serialize(glm::vec4& v);
@@ -112,8 +123,9 @@ public:
     template <typename T>
     bool serializeVector(std::vector<T>& vec)
     {
-        assert(vec.size() <= std::numeric_limits<uint8_t>::max());
-        if (!serialize(static_cast<uint8_t>(vec.size())))
+        assert(vec.size() <= std::numeric_limits<uint32_t>::max());
+        auto num = static_cast<uint32_t>(vec.size());
+        if (!serializeVarint(*this, num))
             return false;
         for (auto& v : vec)
             if (!serialize(v))
@@ -121,6 +133,9 @@ public:
         return true;
     }
 
+    // Writes the lowest bits of value, rounded up to whole bytes
+    bool serializeBits(uint32_t value, size_t bits);
+
 private:
     template <typename T>
     bool serializeInt(T val)
@@ -130,11 +145,13 @@ private:
         return true;
     }
 
+    // Goes through serialize(float), so the components are in network byte order too
     template <typename T>
     bool serializeFor(T& c, size_t n)
     {
         for (size_t i = 0; i < n; ++i)
-            buffer_.write(c[i]);
+            if (!serialize(c[i]))
+                return false;
         return true;
     }
 
@@ -162,6 +179,9 @@ public:
         return read(&obj, 1);
     }
 
+    // Returns a pointer to the next numBytes bytes and skips them or nullptr if there are not enough
+    const uint8_t* readView(size_t numBytes);
+
     size_t getCursor() const;
     size_t getLeft() const;
     bool canRead(size_t numBytes) const;
@@ -174,7 +194,7 @@ private:
 
 class ReadStream {
 public:
-    static constexpr StreamType Type = StreamType::Write;
+    static constexpr StreamType Type = StreamType::Read;
 
     ReadStream(ReadBuffer& buffer);
 
@@ -193,6 +213,8 @@ public:
     bool serialize(int32_t& v);
     bool serialize(float& val);
     bool serialize(std::string& str);
+    // Points into the data of the ReadBuffer, so it is only valid as long as that is
+    bool serialize(std::string_view& str);
     bool serialize(glm::vec2& v);
     bool serialize(glm::vec3& v);
     bool serialize(glm::vec4& v);
@@ -202,8 +224,9 @@ public:
     template <typename T>
     bool serializeVector(std::vector<T>& vec)
     {
-        uint8_t num;
-        if (!serialize(num))
+        uint32_t num = 0;
+        // Every element takes at least a byte, so don't let a corrupt count allocate
+        if (!serializeVarint(*this, num) || num > buffer_.getLeft())
             return false;
         vec.resize(num);
         for (size_t i = 0; i < num; ++i)
@@ -212,6 +235,8 @@ public:
         return true;
     }
 
+    bool serializeBits(uint32_t& value, size_t bits);
+
 private:
     template <typename T>
     bool serializeInt(T& val)
@@ -228,14 +253,361 @@ private:
     bool serializeFor(T& c, size_t n)
     {
         for (size_t i = 0; i < n; ++i)
-            if (!buffer_.read(c[i]))
+            if (!serialize(c[i]))
+                return false;
+        return true;
+    }
+
+    ReadBuffer& buffer_;
+};
+
+// Packs values without padding them to whole bytes, least significant bit first, so a bool takes
+// a single bit and FIELD_RANGED and FIELD_QFLOAT take exactly as many bits as they need. The last
+// byte is padded with zeros when the stream is flushed or destroyed. Only the characters of
+// strings are byte aligned, so they can be read as a std::string_view into the buffer.
+class BitWriteStream {
+public:
+    static constexpr StreamType Type = StreamType::Write;
+
+    BitWriteStream(WriteBuffer& buffer);
+    ~BitWriteStream();
+
+    template <typename T>
+    bool serialize(T& obj)
+    {
+        return obj.serialize(*this);
+    }
+
+    bool serialize(bool v);
+    bool serialize(uint8_t v);
+    bool serialize(int8_t v);
+    bool serialize(uint16_t v);
+    bool serialize(int16_t v);
+    bool serialize(uint32_t v);
+    bool serialize(int32_t v);
+    bool serialize(float val);
+    bool serialize(std::string& str);
+    bool serialize(std::string_view& str);
+    bool serialize(glm::vec2& v);
+    bool serialize(glm::vec3& v);
+    bool serialize(glm::vec4& v);
+    bool serialize(glm::quat& q);
+
+    template <typename T>
+    bool serializeVector(std::vector<T>& vec)
+    {
+        assert(vec.size() <= std::numeric_limits<uint32_t>::max());
+        auto num = static_cast<uint32_t>(vec.size());
+        if (!serializeVarint(*this, num))
+            return false;
+        for (auto& v : vec)
+            if (!serialize(v))
+                return false;
+        return true;
+    }
+
+    // Writes the lowest bits of value
+    bool serializeBits(uint32_t value, size_t bits);
+
+    // Writes out the remaining bits, padded to a whole byte
+    void flush();
+
+private:
+    template <typename T>
+    bool serializeInt(T val)
+    {
+        static_assert(std::is_integral_v<T>);
+        return serializeBits(static_cast<std::make_unsigned_t<T>>(val), sizeof(T) * 8);
+    }
+
+    template <typename T>
+    bool serializeFor(T& c, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            if (!serialize(c[i]))
+                return false;
+        return true;
+    }
+
+    WriteBuffer& buffer_;
+    uint64_t scratch_ = 0;
+    size_t scratchBits_ = 0;
+};
+
+class BitReadStream {
+public:
+    static constexpr StreamType Type = StreamType::Read;
+
+    BitReadStream(ReadBuffer& buffer);
+
+    template <typename T>
+    bool serialize(T& obj)
+    {
+        return obj.serialize(*this);
+    }
+
+    bool serialize(bool& v);
+    bool serialize(uint8_t& v);
+    bool serialize(int8_t& v);
+    bool serialize(uint16_t& v);
+    bool serialize(int16_t& v);
+    bool serialize(uint32_t& v);
+    bool serialize(int32_t& v);
+    bool serialize(float& val);
+    bool serialize(std::string& str);
+    // Points into the data of the ReadBuffer, so it is only valid as long as that is
+    bool serialize(std::string_view& str);
+    bool serialize(glm::vec2& v);
+    bool serialize(glm::vec3& v);
+    bool serialize(glm::vec4& v);
+    bool serialize(glm::quat& q);
+
+    template <typename T>
+    bool serializeVector(std::vector<T>& vec)
+    {
+        uint32_t num = 0;
+        // Every element takes at least a bit, so don't let a corrupt count allocate
+        if (!serializeVarint(*this, num) || num > buffer_.getLeft() * 8 + scratchBits_)
+            return false;
+        vec.resize(num);
+        for (size_t i = 0; i < num; ++i)
+            if (!serialize(vec[i]))
+                return false;
+        return true;
+    }
+
+    bool serializeBits(uint32_t& value, size_t bits);
+
+private:
+    template <typename T>
+    bool serializeInt(T& val)
+    {
+        static_assert(std::is_integral_v<T>);
+        uint32_t r = 0;
+        if (!serializeBits(r, sizeof(T) * 8))
+            return false;
+        val = static_cast<T>(static_cast<std::make_unsigned_t<T>>(r));
+        return true;
+    }
+
+    template <typename T>
+    bool serializeFor(T& c, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            if (!serialize(c[i]))
                 return false;
         return true;
     }
 
     ReadBuffer& buffer_;
+    uint64_t scratch_ = 0;
+    size_t scratchBits_ = 0;
 };
 
+// Computes the maximum size of a serialization with BitWriteStream, which is used to reject
+// oversized packets. Strings and vectors have no maximum.
+class MaxSizeStream {
+public:
+    static constexpr StreamType Type = StreamType::Write;
+
+    template <typename T>
+    bool serialize(T& obj)
+    {
+        return obj.serialize(*this);
+    }
+
+    bool serialize(bool v);
+    bool serialize(uint8_t v);
+    bool serialize(int8_t v);
+    bool serialize(uint16_t v);
+    bool serialize(int16_t v);
+    bool serialize(uint32_t v);
+    bool serialize(int32_t v);
+    bool serialize(float val);
+    bool serialize(std::string&);
+    bool serialize(std::string_view&);
+    bool serialize(glm::vec2& v);
+    bool serialize(glm::vec3& v);
+    bool serialize(glm::vec4& v);
+    bool serialize(glm::quat& q);
+
+    template <typename T>
+    bool serializeVector(std::vector<T>&)
+    {
+        bounded_ = false;
+        return true;
+    }
+
+    bool serializeBits(uint32_t value, size_t bits);
+
+    // In bytes, 0 if there is no maximum
+    size_t getMaxSize() const;
+
+private:
+    size_t bits_ = 0;
+    bool bounded_ = true;
+};
+
+// LEB128: 7 bits per byte, least significant first, and the high bit is set if another byte
+// follows. Signed values are zigzag encoded first (0, -1, 1, -2, ... become 0, 1, 2, 3, ...), so
+// small magnitudes are short too. Values below 128 take a byte, 32 bit values at most 5.
+template <typename Stream, typename T>
+bool serializeVarint(Stream& stream, T& v)
+{
+    static_assert(std::is_integral_v<T> && sizeof(T) <= sizeof(uint32_t));
+    uint32_t value = 0;
+    if constexpr (Stream::Type == StreamType::Write) {
+        if constexpr (std::is_signed_v<T>)
+            value = (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(-(v < 0));
+        else
+            value = v;
+        do {
+            const auto byte = value & 0x7f;
+            value >>= 7;
+            if (!stream.serializeBits(value ? byte | 0x80 : byte, 8))
+                return false;
+        } while (value);
+        return true;
+    } else {
+        for (size_t shift = 0;; shift += 7) {
+            uint32_t byte = 0;
+            // The fifth byte may only contain the 4 top bits
+            if (!stream.serializeBits(byte, 8) || (shift == 28 && byte > 0xf))
+                return false;
+            value |= (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        if constexpr (std::is_signed_v<T>) {
+            const auto decoded = static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+            if (decoded < std::numeric_limits<T>::min() || decoded > std::numeric_limits<T>::max())
+                return false;
+            v = static_cast<T>(decoded);
+        } else {
+            if (value > std::numeric_limits<T>::max())
+                return false;
+            v = static_cast<T>(value);
+        }
+        return true;
+    }
+}
+
+template <typename T>
+bool serializeVarint(MaxSizeStream& stream, T&)
+{
+    static_assert(std::is_integral_v<T> && sizeof(T) <= sizeof(uint32_t));
+    return stream.serializeBits(0, (sizeof(T) * 8 + 6) / 7 * 8);
+}
+
+// Number of bits needed to store all values in [0, range]
+constexpr size_t bitsRequired(uint64_t range)
+{
+    size_t bits = 0;
+    while (range) {
+        bits++;
+        range >>= 1;
+    }
+    return bits;
+}
+
+// Serializes an integer in [min, max] with as few bits as possible. Deserializing fails if the
+// value is out of range.
+template <typename Stream, typename T>
+bool serializeRanged(Stream& stream, T& v, int64_t min, int64_t max)
+{
+    static_assert(std::is_integral_v<T>);
+    assert(min <= max && max - min <= std::numeric_limits<uint32_t>::max());
+    const auto range = static_cast<uint64_t>(max - min);
+    if constexpr (Stream::Type == StreamType::Write) {
+        assert(static_cast<int64_t>(v) >= min && static_cast<int64_t>(v) <= max);
+        return stream.serializeBits(
+            static_cast<uint32_t>(static_cast<int64_t>(v) - min), bitsRequired(range));
+    } else {
+        uint32_t value = 0;
+        if (!stream.serializeBits(value, bitsRequired(range)) || value > range)
+            return false;
+        v = static_cast<T>(min + value);
+        return true;
+    }
+}
+
+// Serializes a float in [min, max] as an integer with steps of at most precision. Values outside
+// of the range are clamped.
+template <typename Stream>
+bool serializeQuantized(Stream& stream, float& v, float min, float max, float precision)
+{
+    assert(min < max && precision > 0.0f);
+    const auto steps = static_cast<uint32_t>(std::ceil((max - min) / precision));
+    uint32_t value = 0;
+    if constexpr (Stream::Type == StreamType::Write) {
+        const auto t = (std::clamp(v, min, max) - min) / (max - min);
+        value = static_cast<uint32_t>(std::round(t * steps));
+    }
+    if (!serializeRanged(stream, value, 0, steps))
+        return false;
+    if constexpr (Stream::Type == StreamType::Read)
+        v = min + static_cast<float>(value) / steps * (max - min);
+    return true;
+}
+
+// Quantizes every component like above
+template <typename Stream>
+bool serializeQuantized(
+    Stream& stream, glm::vec3& v, const glm::vec3& min, const glm::vec3& max, float precision)
+{
+    for (int i = 0; i < 3; ++i)
+        if (!serializeQuantized(stream, v[i], min[i], max[i], precision))
+            return false;
+    return true;
+}
+
+// "Smallest three": The index of the largest component is written with 2 bits and the other three
+// components with bitsPerComponent each. The largest one is reconstructed from the others, because
+// the quaternion is normalized. Its sign is flipped to positive, since q and -q are the same
+// rotation, which puts the others in [-1/sqrt(2), 1/sqrt(2)].
+template <typename Stream>
+bool serializeQuaternion(Stream& stream, glm::quat& q, size_t bitsPerComponent = 9)
+{
+    static constexpr float maxComponent = 0.70710678f;
+    assert(bitsPerComponent > 0 && bitsPerComponent <= 16);
+    const auto steps = (1u << bitsPerComponent) - 1;
+
+    uint32_t largest = 0;
+    glm::quat n; // only used when writing
+    float sign = 1.0f;
+    if constexpr (Stream::Type == StreamType::Write) {
+        // A zero quaternion (e.g. value-initialized) is sent as identity
+        n = glm::dot(q, q) > 0.0f ? glm::normalize(q) : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        for (int i = 1; i < 4; ++i)
+            if (std::abs(n[i]) > std::abs(n[largest]))
+                largest = i;
+        sign = n[largest] < 0.0f ? -1.0f : 1.0f;
+    }
+    if (!serializeRanged(stream, largest, 0, 3))
+        return false;
+
+    float sumSquares = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+        if (i == static_cast<int>(largest))
+            continue;
+        uint32_t value = 0;
+        if constexpr (Stream::Type == StreamType::Write) {
+            const auto c = std::clamp(n[i] * sign, -maxComponent, maxComponent);
+            value = static_cast<uint32_t>(
+                std::round((c + maxComponent) / (2.0f * maxComponent) * steps));
+        }
+        if (!serializeRanged(stream, value, 0, steps))
+            return false;
+        if constexpr (Stream::Type == StreamType::Read) {
+            q[i] = static_cast<float>(value) / steps * 2.0f * maxComponent - maxComponent;
+            sumSquares += q[i] * q[i];
+        }
+    }
+    if constexpr (Stream::Type == StreamType::Read)
+        q[largest] = std::sqrt(std::max(0.0f, 1.0f - sumSquares));
+    return true;
+}
+
 #define SERIALIZE()                                                                                \
     template <typename Stream>                                                                     \
     bool serialize(Stream& stream)
@@ -257,16 +629,41 @@ private:
             return false;                                                                          \
     } while (0)
 
-template <typename T>
+// These work with all streams, but byte streams round the number of bits up to whole bytes
+#define FIELD_RANGED(v, min, max)                                                                  \
+    do {                                                                                           \
+        if (!serializeRanged(stream, v, min, max))                                                 \
+            return false;                                                                          \
+    } while (0)
+
+#define FIELD_QFLOAT(v, min, max, precision)                                                       \
+    do {                                                                                           \
+        if (!serializeQuantized(stream, v, min, max, precision))                                   \
+            return false;                                                                          \
+    } while (0)
+
+#define FIELD_VARINT(v)                                                                            \
+    do {                                                                                           \
+        if (!serializeVarint(stream, v))                                                           \
+            return false;                                                                          \
+    } while (0)
+
+#define FIELD_QUAT(q)                                                                              \
+    do {                                                                                           \
+        if (!serializeQuaternion(stream, q))                                                       \
+            return false;                                                                          \
+    } while (0)
+
+template <typename Stream = WriteStream, typename T>
 bool serialize(WriteBuffer& buffer, T& object)
 {
-    WriteStream stream(buffer);
+    Stream stream(buffer);
     return stream.serialize(object);
 }
 
-template <typename T>
+template <typename Stream = ReadStream, typename T>
 bool deserialize(ReadBuffer& buffer, T& object)
 {
-    ReadStream stream(buffer);
+    Stream stream(buffer);
     return stream.serialize(object);
 }
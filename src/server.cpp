@@ -1,5 +1,6 @@
 #include "server.hpp"
 
+#include <algorithm>
 #include <cassert>
 
 #include <fmt/format.h>
@@ -15,6 +16,8 @@ namespace {
 
 namespace comp {
 struct NetworkPlayer {
+    static constexpr bool SparseStorage = true;
+
     uint32_t lastUpdatedFrame = 0;
 };
 }
@@ -37,6 +40,16 @@ bool Server::run(const std::string& host, Port port, uint32_t gameCode, float ex
     shipGltf->instantiate(world_, true);
     world_.flush();
 
+    world_.forEachEntity<const comp::BoxCollider, const comp::Transform>(
+        [](ecs::EntityHandle entity, const comp::BoxCollider& collider,
+            const comp::Transform& trafo) {
+            const auto& pos = trafo.getPosition();
+            if (!isInNetPositionBounds(pos - collider.halfExtents)
+                || !isInNetPositionBounds(pos + collider.halfExtents))
+                printErr("Collider '{}' is outside of the network position bounds",
+                    comp::Name::get(entity));
+        });
+
     println("Done");
 
     shipSystems_.emplace("reactor",
@@ -78,6 +91,8 @@ bool Server::run(const std::string& host, Port port, uint32_t gameCode, float ex
         while (accumulator >= dt) {
             processEnetEvents();
             tick(dt);
+            for (auto& player : players_)
+                player.outgoing.flush();
             host_.flush();
             accumulator -= dt;
             time_ += dt;
@@ -96,7 +111,12 @@ bool Server::run(const std::string& host, Port port, uint32_t gameCode, float ex
 
 void Server::tick(float /*dt*/)
 {
-    for (auto& [name, system] : shipSystems_) {
+    // Messages that are the same for several players are only serialized once (see sendIf). The
+    // deltas depend on what a player knows already, so players are grouped by that, but usually
+    // all of them are in the same group.
+    for (auto& [systemName, system] : shipSystems_) {
+        // Structured bindings can't be captured
+        const auto& name = systemName;
         system.system->update();
 
         const auto terminalEnabled = !system.system->commandRunning();
@@ -104,62 +124,100 @@ void Server::tick(float /*dt*/)
         const auto totalOutputSize = system.system->getTotalTerminalOutputSize();
         const auto& output = system.system->getTerminalOutput();
         for (auto& player : players_) {
-            auto& lastKnown = player.lastKnownSystemState[name];
-
-            const auto lastKnownTermSize = lastKnown.terminalSize;
+            const auto lastKnownTermSize = player.lastKnownSystemState[name].terminalSize;
             assert(totalOutputSize >= lastKnownTermSize);
             const auto deltaLength = totalOutputSize - lastKnownTermSize;
-            if (deltaLength > 0) {
-                const auto maxDeltaLength = std::min(deltaLength, output.size());
-                const auto delta = output.substr(output.size() - maxDeltaLength);
-                send(player, Channel::Reliable,
-                    Message<MessageType::ServerUpdateTerminalOutput> { name, delta });
-                lastKnown.terminalSize = totalOutputSize;
-            }
+            if (deltaLength == 0)
+                continue;
+            const auto maxDeltaLength = std::min(deltaLength, output.size());
+            const auto delta = output.substr(output.size() - maxDeltaLength);
+            const auto sameDelta = [&name, lastKnownTermSize](Player& other) {
+                return other.lastKnownSystemState[name].terminalSize == lastKnownTermSize;
+            };
+            sendIf(Channel::Reliable,
+                Message<MessageType::ServerUpdateTerminalOutput> { name, delta }, sameDelta);
+            for (auto& other : players_)
+                if (sameDelta(other))
+                    other.lastKnownSystemState[name].terminalSize = totalOutputSize;
+        }
 
-            if (terminalEnabled != lastKnown.terminalEnabled) {
-                send(player, Channel::Reliable,
-                    Message<MessageType::ServerUpdateInputEnabled> { name, terminalEnabled });
-                lastKnown.terminalEnabled = terminalEnabled;
-            }
+        sendIf(Channel::Reliable,
+            Message<MessageType::ServerUpdateInputEnabled> { name, terminalEnabled },
+            [&name, terminalEnabled](Player& player) {
+                return player.lastKnownSystemState[name].terminalEnabled != terminalEnabled;
+            });
 
+        for (auto& player : players_) {
+            const auto lastKnownHistCount = player.lastKnownSystemState[name].historyCount;
             const auto deltaHist
-                = std::min(system.history.size(), system.historyCount - lastKnown.historyCount);
-            if (deltaHist > 0) {
-                Message<MessageType::ServerAddTerminalHistory> message { name, {} };
-                message.commands.reserve(deltaHist);
-                for (size_t i = system.history.size() - deltaHist; i < system.history.size(); ++i) {
-                    message.commands.push_back(system.history[i]);
-                }
-                send(player, Channel::Reliable, message);
-                lastKnown.historyCount = system.historyCount;
+                = std::min(system.history.size(), system.historyCount - lastKnownHistCount);
+            if (deltaHist == 0)
+                continue;
+            Message<MessageType::ServerAddTerminalHistory> message { name, {} };
+            message.commands.reserve(deltaHist);
+            for (size_t i = system.history.size() - deltaHist; i < system.history.size(); ++i) {
+                message.commands.push_back(system.history[i]);
             }
+            const auto sameDelta = [&name, lastKnownHistCount](Player& other) {
+                return other.lastKnownSystemState[name].historyCount == lastKnownHistCount;
+            };
+            sendIf(Channel::Reliable, message, sameDelta);
+            for (auto& other : players_)
+                if (sameDelta(other))
+                    other.lastKnownSystemState[name].historyCount = system.historyCount;
+        }
 
-            if (system.terminalUser != lastKnown.terminalUser) {
-                send(player, Channel::Reliable,
-                    Message<MessageType::ServerInteractTerminal> { name, system.terminalUser });
-                lastKnown.terminalUser = system.terminalUser;
-            }
+        const auto terminalUser = system.terminalUser;
+        sendIf(Channel::Reliable,
+            Message<MessageType::ServerInteractTerminal> { name, terminalUser },
+            [&name, terminalUser](Player& player) {
+                return player.lastKnownSystemState[name].terminalUser != terminalUser;
+            });
+
+        for (auto& player : players_) {
+            auto& lastKnown = player.lastKnownSystemState[name];
+            lastKnown.terminalEnabled = terminalEnabled;
+            lastKnown.terminalUser = terminalUser;
         }
     }
 
-    const auto shipStateMessage = Message<MessageType::ServerUpdateShipState> {
-        LuaShipSystem::shipState.engineThrottle,
-        LuaShipSystem::shipState.reactorPower,
-    };
+    const auto& shipState = LuaShipSystem::shipState;
+    sendIf(Channel::Reliable,
+        Message<MessageType::ServerUpdateShipState> {
+            shipState.engineThrottle, shipState.reactorPower },
+        [&shipState](Player& player) { return player.lastKnownShipState != shipState; });
 
-    auto update = Message<MessageType::ServerPlayerStateUpdate>();
+    PlayerStateList playerStates;
     for (auto& player : players_) {
-        const auto& trafo = player.entity.get<comp::Transform>();
-        update.players.push_back(Message<MessageType::ServerPlayerStateUpdate>::PlayerState {
-            player.id, trafo.getPosition(), trafo.getOrientation() });
+        const auto& trafo = player.entity.get<const comp::Transform>();
+        playerStates.push_back(Message<MessageType::ServerPlayerStateUpdate>::PlayerState {
+            player.id, clampNetPosition(trafo.getPosition(), player.outsideNetBounds),
+            trafo.getOrientation() });
+        player.lastKnownShipState = shipState;
+    }
+    playerStateHistory_.add(frameCounter_, playerStates);
+
+    // The ack comes from the client, so it might not be in the history (anymore) or even be in the
+    // future. Those players get all players with all fields.
+    const auto getBaselineFrame = [this](const Player& player) {
+        const auto ackedFrame = player.ackedPlayerStateFrame;
+        return playerStateHistory_.findBaseline(frameCounter_, ackedFrame) ? ackedFrame
+                                                                           : InvalidFrame;
+    };
 
-        if (LuaShipSystem::shipState != player.lastKnownShipState) {
-            send(player, Channel::Reliable, shipStateMessage);
-            player.lastKnownShipState = LuaShipSystem::shipState;
-        }
+    // Players with the same baseline get the same delta
+    for (size_t i = 0; i < players_.size(); ++i) {
+        const auto baselineFrame = getBaselineFrame(players_[i]);
+        const auto sameBaseline = [&getBaselineFrame, baselineFrame](const Player& other) {
+            return getBaselineFrame(other) == baselineFrame;
+        };
+        if (std::any_of(players_.begin(), players_.begin() + i, sameBaseline))
+            continue;
+        sendIf(Channel::Unreliable,
+            makePlayerStateDelta(frameCounter_, baselineFrame,
+                playerStateHistory_.find(baselineFrame), playerStates),
+            sameBaseline);
     }
-    broadcast(Channel::Unreliable, update);
 
     if (players_.empty()) {
         if (time_ - lastNonEmpty_ > exitTimeout_) {
@@ -212,6 +270,7 @@ PlayerId Server::Player::getNextId()
 
 Server::Player::Player(ENetPeer* peer)
     : peer(peer)
+    , outgoing(peer)
     , id(getNextId())
 {
 }
@@ -233,7 +292,7 @@ void Server::findSpawnPosition(Player& player)
 {
     static std::vector<glwx::Transform> spawnPoints;
     if (spawnPoints.empty()) {
-        world_.forEachEntity<comp::SpawnPoint, comp::Transform>(
+        world_.forEachEntity<const comp::SpawnPoint, const comp::Transform>(
             [](ecs::EntityHandle entity, const comp::SpawnPoint&, const comp::Transform& trafo) {
                 spawnPoints.push_back(trafo);
                 const auto pos = trafo.getPosition();
@@ -287,33 +346,26 @@ void Server::disconnectPlayer(PlayerId id)
     }
 }
 
-#define MESSAGE_CASE(Type)                                                                         \
-    case MessageType::Type:                                                                        \
-        processMessage<MessageType::Type>(player, header.frameNumber, buffer);                     \
-        break;
-
 void Server::receive(PlayerId id, uint8_t channelId, const enet::Packet& packet)
 {
+    static constexpr auto handlers = makeMessageHandlers<MessageType::ClientMoveUpdate,
+        MessageType::ClientInteractTerminal, MessageType::ClientUpdateTerminalInput,
+        MessageType::ClientExecuteCommand, MessageType::ClientPlaySound>();
+
     auto& player = players_[getPlayerIndex(id)];
-    ReadBuffer buffer(packet.getData<uint8_t>(), packet.getSize());
-    CommonMessageHeader header;
-    if (!deserialize(buffer, header)) {
-        printErr("Could not decode common message header");
-        return; // Ignore message
-    }
-    const auto messageType = static_cast<MessageType>(header.messageType);
-    if (static_cast<Channel>(channelId) == Channel::Reliable) {
-        // println("[server] Received message: {}", asString(messageType));
-    }
-    switch (messageType) {
-        MESSAGE_CASE(ClientMoveUpdate);
-        MESSAGE_CASE(ClientInteractTerminal);
-        MESSAGE_CASE(ClientUpdateTerminalInput);
-        MESSAGE_CASE(ClientExecuteCommand);
-        MESSAGE_CASE(ClientPlaySound);
-    default:
-        printErr("Received unrecognized message: {}", asString(messageType));
-    }
+    const auto valid = forEachMessage(packet.getData<uint8_t>(), packet.getSize(),
+        [this, &player, channelId](
+            uint32_t frameNumber, MessageType messageType, ReadBuffer& buffer) {
+            if (static_cast<Channel>(channelId) == Channel::Reliable) {
+                // println("[server] Received message: {}", asString(messageType));
+            }
+            const auto handler
+                = findMessageHandler(handlers, messageType, channelId, buffer.getLeft());
+            if (handler)
+                (this->*handler)(player, frameNumber, buffer);
+        });
+    if (!valid)
+        printErr("Could not decode packet"); // Ignore the rest
 }
 
 void Server::processMessage(
@@ -325,6 +377,7 @@ void Server::processMessage(
         trafo.setPosition(message.position);
         trafo.setOrientation(message.orientation);
         net.lastUpdatedFrame = frameNumber;
+        player.ackedPlayerStateFrame = message.getAckedFrame(frameCounter_);
     }
 }
 
@@ -348,7 +401,7 @@ void Server::processMessage(Player& player, uint32_t /*frameNumber*/,
         }
         shipSystems_.at(*terminal).terminalUser = InvalidPlayerId;
     } else {
-        const auto it = shipSystems_.find(message.terminal);
+        const auto it = shipSystems_.find(std::string(message.terminal));
         if (it == shipSystems_.end())
             return; // garbage, do nothing
 
@@ -386,14 +439,14 @@ void Server::processMessage(Player& player, uint32_t /*frameNumber*/,
     auto& system = shipSystems_.at(*systemName);
 
     if (!message.command.empty()) {
-        system.history.push_back(message.command);
+        system.history.emplace_back(message.command);
         system.historyCount++;
         while (system.history.size() > 32) {
             system.history.pop_front();
         }
     }
 
-    system.system->executeCommand(message.command);
+    system.system->executeCommand(std::string(message.command));
 }
 
 void Server::processMessage(
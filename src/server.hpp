@@ -31,9 +31,12 @@ private:
 
         ecs::EntityHandle entity;
         ENetPeer* peer;
+        MessageQueue outgoing;
         PlayerId id;
         std::unordered_map<ShipSystem::Name, LastKnownSystemState> lastKnownSystemState;
         ShipState lastKnownShipState;
+        uint32_t ackedPlayerStateFrame = InvalidFrame;
+        bool outsideNetBounds = false;
 
         static PlayerId getNextId();
 
@@ -51,32 +54,44 @@ private:
     };
 
     template <MessageType MsgType>
-    void broadcast(Channel channel, const Message<MsgType>& message)
+    bool broadcast(Channel channel, const Message<MsgType>& message)
     {
-        const auto buffer = serializeMessage(frameCounter_, message);
-        host_.broadcast(static_cast<uint8_t>(channel),
-            enet::Packet(buffer.getData(), buffer.getSize(), getChannelFlags(channel)));
+        return sendIf(channel, message, [](const Player&) { return true; });
     }
 
     template <MessageType MsgType>
     bool send(Player& player, Channel channel, const Message<MsgType>& message)
     {
-        return sendMessage(player.peer, channel, frameCounter_, message);
+        return player.outgoing.add(channel, frameCounter_, message);
     }
 
-    // Sends to everyone, but the passed player
-    template <MessageType MsgType>
-    bool distribute(Player& player, Channel channel, const Message<MsgType>& message)
+    // Sends to every player for which filter(player) is true. The message is serialized at most
+    // once and the data is copied into the queue of every player, so the cost of serialization
+    // does not grow with the number of players.
+    template <MessageType MsgType, typename Filter>
+    bool sendIf(Channel channel, const Message<MsgType>& message, Filter&& filter)
     {
+        assert(channel == Message<MsgType>::AllowedChannel);
+        const WriteBuffer* data = nullptr;
         bool ret = true;
-        for (auto& other : players_) {
-            if (other.id != player.id) {
-                ret = send(other, channel, message) && ret;
-            }
+        for (auto& player : players_) {
+            if (!filter(player))
+                continue;
+            if (!data)
+                data = &serializeMessageData(message);
+            ret = player.outgoing.add(channel, frameCounter_, MsgType, *data) && ret;
         }
         return ret;
     }
 
+    // Sends to everyone, but the passed player
+    template <MessageType MsgType>
+    bool distribute(Player& player, Channel channel, const Message<MsgType>& message)
+    {
+        return sendIf(channel, message,
+            [&player](const Player& other) { return other.id != player.id; });
+    }
+
     void processEnetEvents();
     void tick(float dt);
 
@@ -92,13 +107,23 @@ private:
     void processMessage(Player& player, uint32_t frameNumber, ReadBuffer& buffer)
     {
         Message<MsgType> message;
-        if (!deserialize(buffer, message)) {
-            printErr("Could not decode message of type {}", MsgType);
+        if (!deserialize<BitReadStream>(buffer, message)) {
+            printErr("Could not decode message of type {}", asString(MsgType));
             return;
         }
         processMessage(player, frameNumber, message);
     }
 
+    using MessageHandler = void (Server::*)(Player&, uint32_t, ReadBuffer&);
+
+    template <MessageType... MsgTypes>
+    static constexpr MessageHandlerTable<MessageHandler> makeMessageHandlers()
+    {
+        MessageHandlerTable<MessageHandler> handlers {};
+        ((handlers[static_cast<size_t>(MsgTypes)] = &Server::processMessage<MsgTypes>), ...);
+        return handlers;
+    }
+
     void processMessage(Player& player, uint32_t frameNumber,
         const Message<MessageType::ClientMoveUpdate>& message);
 
@@ -118,6 +143,7 @@ private:
     ecs::World world_;
     std::vector<Player> players_;
     std::unordered_map<ShipSystem::Name, ShipSystemData> shipSystems_;
+    PlayerStateHistory playerStateHistory_;
     float time_ = 0.0f;
     uint32_t frameCounter_ = 0;
     uint32_t connectCode_ = 0;
@@ -0,0 +1,114 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+static constexpr size_t NoQueue = std::numeric_limits<size_t>::max();
+// Index of the queue owned by the current thread, if it is a worker
+thread_local size_t currentQueue = NoQueue;
+}
+
+bool ThreadPool::TaskGroup::isDone() const
+{
+    return pending_.load(std::memory_order_acquire) == 0;
+}
+
+ThreadPool::ThreadPool()
+{
+    // Leave one core for the thread that pushes the tasks (it helps out while waiting)
+    const auto threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    for (size_t i = 0; i < threadCount; ++i)
+        queues_.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < threadCount; ++i)
+        threads_.emplace_back(&ThreadPool::workerMain, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stop_ = true;
+    }
+    sleepCondition_.notify_all();
+    for (auto& thread : threads_)
+        thread.join();
+}
+
+size_t ThreadPool::getThreadCount() const
+{
+    return threads_.size();
+}
+
+void ThreadPool::push(TaskGroup& group, Task task)
+{
+    const auto queueIndex
+        = currentQueue != NoQueue ? currentQueue : nextQueue_++ % queues_.size();
+    group.pending_.fetch_add(1, std::memory_order_relaxed);
+    {
+        auto& queue = *queues_[queueIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(Job { std::move(task), &group });
+    }
+    queuedJobs_.fetch_add(1);
+    {
+        // Make sure a worker that just checked queuedJobs_ is waiting before we notify
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+    }
+    sleepCondition_.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup& group)
+{
+    while (!group.isDone()) {
+        if (!runJob(currentQueue != NoQueue ? currentQueue : 0))
+            std::this_thread::yield();
+    }
+}
+
+void ThreadPool::workerMain(size_t index)
+{
+    currentQueue = index;
+    while (true) {
+        if (runJob(index))
+            continue;
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        sleepCondition_.wait(lock, [this] { return stop_ || queuedJobs_.load() > 0; });
+        if (stop_ && queuedJobs_.load() == 0)
+            return;
+    }
+}
+
+std::optional<ThreadPool::Job> ThreadPool::popJob(size_t queueIndex)
+{
+    {
+        auto& own = *queues_[queueIndex];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            auto job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            return job;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        auto& other = *queues_[(queueIndex + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.jobs.empty()) {
+            auto job = std::move(other.jobs.front());
+            other.jobs.pop_front();
+            return job;
+        }
+    }
+    return std::nullopt;
+}
+
+bool ThreadPool::runJob(size_t queueIndex)
+{
+    auto job = popJob(queueIndex);
+    if (!job)
+        return false;
+    queuedJobs_.fetch_sub(1);
+    job->task();
+    job->group->pending_.fetch_sub(1, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "singleton.hpp"
+
+// Every worker has its own queue and takes tasks from the back of it. If it is empty, it steals
+// from the front of the other workers' queues. Threads waiting for a TaskGroup execute tasks too,
+// so it is fine to push and wait from inside a task.
+class ThreadPool : public Singleton<ThreadPool> {
+    friend class Singleton<ThreadPool>;
+
+public:
+    using Task = std::function<void()>;
+
+    class TaskGroup {
+    public:
+        TaskGroup() = default;
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        bool isDone() const;
+
+    private:
+        friend class ThreadPool;
+
+        std::atomic<size_t> pending_ { 0 };
+    };
+
+    ~ThreadPool();
+
+    size_t getThreadCount() const;
+
+    void push(TaskGroup& group, Task task);
+
+    // Runs tasks on the calling thread until all tasks in the group are done
+    void wait(TaskGroup& group);
+
+private:
+    struct Job {
+        Task task;
+        TaskGroup* group;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    ThreadPool();
+
+    void workerMain(size_t index);
+    std::optional<Job> popJob(size_t queueIndex);
+    bool runJob(size_t queueIndex);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> nextQueue_ { 0 };
+    std::atomic<size_t> queuedJobs_ { 0 };
+    std::mutex sleepMutex_;
+    std::condition_variable sleepCondition_;
+    bool stop_ = false;
+};
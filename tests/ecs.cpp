@@ -0,0 +1,603 @@
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "ecs.hpp"
+
+namespace {
+int failures = 0;
+
+template <typename... Args>
+void fail(Args&&... args)
+{
+    fmt::print(stderr, std::forward<Args>(args)...);
+    ++failures;
+}
+
+struct A {
+    int value;
+};
+
+struct B {
+    int value;
+};
+
+// Snapshotted with its copy constructor
+struct Name {
+    std::string value;
+};
+
+// Snapshotted with the SnapshotHook below
+struct Unique {
+    std::unique_ptr<int> value;
+};
+
+// Can not be snapshotted
+struct NoCopy {
+    std::unique_ptr<int> value;
+};
+
+struct Sparse {
+    static constexpr bool SparseStorage = true;
+
+    int value;
+};
+}
+
+template <>
+struct ecs::SnapshotHook<Unique> {
+    static constexpr bool Supported = true;
+
+    static Unique copy(const Unique& component)
+    {
+        return Unique { std::make_unique<int>(*component.value) };
+    }
+};
+
+namespace {
+
+// Half of the entities only have A, the other half have A and B, so the archetype of A is walked
+// before the archetype of A and B.
+std::vector<ecs::EntityId> createEntities(ecs::World& world, size_t count)
+{
+    std::vector<ecs::EntityId> ids;
+    for (size_t i = 0; i < count; ++i) {
+        auto entity = world.createEntity();
+        entity.add<A>(A { static_cast<int>(i) });
+        if (i >= count / 2)
+            entity.add<B>(B { static_cast<int>(i) });
+        ids.push_back(entity.getId());
+    }
+    world.flush();
+    // Register the query, so the archetypes are in creation order
+    world.forEachEntity<A>([](const A&) {});
+    return ids;
+}
+
+void checkVisits(const std::vector<int>& visits, const std::vector<int>& expected, const char* name)
+{
+    for (size_t i = 0; i < visits.size(); ++i) {
+        if (visits[i] != expected[i])
+            fail("{}: entity {} was visited {} times, expected {}\n", name, i, visits[i],
+                expected[i]);
+    }
+}
+
+// Adding B moves the entity into an archetype that is walked later
+void testAddComponent()
+{
+    ecs::World world;
+    const auto ids = createEntities(world, 100);
+    std::vector<int> visits(ids.size(), 0);
+    world.forEachEntity<A>([&visits](ecs::EntityHandle entity, A& a) {
+        visits[a.value]++;
+        if (!entity.has<B>())
+            entity.add<B>(B { a.value });
+    });
+    checkVisits(visits, std::vector<int>(ids.size(), 1), "add component");
+
+    size_t count = 0;
+    world.forEachEntity<const A, const B>([&count](const A&, const B&) { count++; });
+    if (count != ids.size())
+        fail("add component: {} entities have B, expected {}\n", count, ids.size());
+}
+
+// Removing B from an entity that was not visited yet, skips it
+void testRemoveComponent()
+{
+    ecs::World world;
+    const auto ids = createEntities(world, 100);
+    std::vector<int> visits(ids.size(), 0);
+    world.forEachEntity<const B>([&](ecs::EntityHandle, const B& b) {
+        visits[b.value]++;
+        for (const auto id : ids) {
+            auto other = world.getEntityHandle(id);
+            if (other.has<B>() && visits[other.get<const B>().value] == 0) {
+                other.remove<B>();
+                break;
+            }
+        }
+    });
+    for (size_t i = 0; i < visits.size(); ++i) {
+        if (visits[i] > 1)
+            fail("remove component: entity {} was visited {} times\n", i, visits[i]);
+    }
+}
+
+// Destroying an entity that was not visited yet used to swap one that was into its place
+void testDestroyEntity()
+{
+    ecs::World world;
+    const auto ids = createEntities(world, 100);
+    std::vector<int> visits(ids.size(), 0);
+    std::vector<int> expected(ids.size(), 1);
+    world.forEachEntity<A>([&](ecs::EntityHandle, A& a) {
+        visits[a.value]++;
+        // The first entity of an archetype is visited last
+        const auto first = a.value < 50 ? 0 : 50;
+        if (visits[first] == 0 && expected[first] == 1) {
+            world.destroyEntity(ids[first]);
+            expected[first] = 0;
+        }
+    });
+    checkVisits(visits, expected, "destroy entity");
+
+    size_t count = 0;
+    world.forEachEntity<const A>([&count](const A&) { count++; });
+    if (count != ids.size() - 2)
+        fail("destroy entity: {} entities left, expected {}\n", count, ids.size() - 2);
+
+    // The ids are free after the iteration
+    world.createEntity();
+    world.createEntity();
+    if (world.getEntityCount() != ids.size())
+        fail("destroy entity: ids were not reused\n");
+}
+
+// Created entities are not visited, but are in the right archetypes afterwards
+void testCreateEntity()
+{
+    ecs::World world;
+    const auto ids = createEntities(world, 10);
+    size_t visits = 0;
+    world.forEachEntity<const A>([&](const A&) {
+        visits++;
+        world.createEntity().add<A>(A { -1 });
+    });
+    if (visits != ids.size())
+        fail("create entity: {} visits, expected {}\n", visits, ids.size());
+
+    world.flush();
+    size_t count = 0;
+    world.forEachEntity<const A>([&count](const A&) { count++; });
+    if (count != 2 * ids.size())
+        fail("create entity: {} entities, expected {}\n", count, 2 * ids.size());
+}
+
+// Batches start with their components and only create the archetype of all of them
+void testCreateEntities()
+{
+    ecs::World world;
+    const auto first = world.createEntities<A, B>(10);
+    world.createEntity();
+    const auto second = world.createEntities<A, B>(10);
+    world.flush();
+    if (second != first + 11)
+        fail("create entities: second batch starts at {}, expected {}\n", second, first + 11);
+
+    // The empty one of the single entity and A + B, but not A
+    const auto archetypeCount = world.getQuery(ecs::ComponentMask()).archetypes.size();
+    if (archetypeCount != 2)
+        fail("create entities: {} archetypes, expected 2\n", archetypeCount);
+
+    size_t count = 0;
+    world.forEachEntity<const A, const B>([&count](const A& a, const B& b) {
+        if (a.value != 0 || b.value != 0)
+            fail("create entities: components were not value-initialized\n");
+        count++;
+    });
+    if (count != 20)
+        fail("create entities: {} entities with A and B, expected 20\n", count);
+}
+
+// Entities that are created or destroyed after the save and components of all pool types that are
+// changed, added or removed are all reverted.
+void testSnapshot()
+{
+    ecs::World world;
+    const size_t count = 100;
+    for (size_t i = 0; i < count; ++i) {
+        const auto value = static_cast<int>(i);
+        auto entity = world.createEntity();
+        entity.add<A>(A { value });
+        if (i % 2 == 0)
+            entity.add<B>(B { value });
+        if (i % 3 == 0)
+            entity.add<Name>(Name { std::to_string(i) });
+        if (i % 5 == 0)
+            entity.add<Unique>(Unique { std::make_unique<int>(value) });
+        if (i % 10 == 0)
+            entity.add<Sparse>(Sparse { value });
+    }
+    world.flush();
+    world.destroyEntity(70);
+    world.destroyEntity(30);
+
+    std::vector<ecs::ComponentMask> masks;
+    std::vector<bool> valid;
+    size_t sparseCount = 0;
+    for (ecs::EntityId id = 0; id < count; ++id) {
+        masks.push_back(world.getComponentMask(id));
+        valid.push_back(world.isValid(id));
+        sparseCount += world.hasComponents<Sparse>(id);
+    }
+
+    ecs::World::Snapshot snapshot;
+    if (!world.saveSnapshot(snapshot)) {
+        fail("snapshot: could not save\n");
+        return;
+    }
+
+    world.getComponent<A>(0).value = -1;
+    world.getComponent<Name>(0).value = "changed";
+    *world.getComponent<Unique>(0).value = -1;
+    world.getComponent<Sparse>(0).value = -1;
+    world.removeComponent<B>(2);
+    world.addComponent<B>(1, B { -1 });
+    world.removeComponent<Sparse>(10);
+    world.addComponent<Sparse>(11, Sparse { -1 });
+    world.destroyEntity(4);
+    for (size_t i = 0; i < 3; ++i)
+        world.createEntity().add<A>(A { -1 });
+    world.flush();
+
+    const auto since = world.advanceVersion();
+    world.restoreSnapshot(snapshot);
+
+    if (world.getEntityCount() != count)
+        fail("snapshot: {} entities, expected {}\n", world.getEntityCount(), count);
+    size_t validCount = 0;
+    for (ecs::EntityId id = 0; id < count; ++id) {
+        if (world.isValid(id) != valid[id] || world.getComponentMask(id) != masks[id]) {
+            fail("snapshot: entity {} was not restored\n", id);
+            continue;
+        }
+        if (!valid[id])
+            continue;
+        validCount++;
+        const auto value = static_cast<int>(id);
+        auto entity = world.getEntityHandle(id);
+        if (entity.get<const A>().value != value
+            || (entity.has<B>() && entity.get<const B>().value != value)
+            || (entity.has<Name>() && entity.get<const Name>().value != std::to_string(id))
+            || (entity.has<Unique>() && *entity.get<const Unique>().value != value)
+            || (entity.has<Sparse>() && entity.get<const Sparse>().value != value))
+            fail("snapshot: components of entity {} were not restored\n", id);
+    }
+
+    // The archetypes have to match the masks again
+    size_t visits = 0;
+    world.forEachEntity<const A>([&visits](const A&) { visits++; });
+    if (visits != validCount)
+        fail("snapshot: {} entities with A, expected {}\n", visits, validCount);
+    size_t sparseVisits = 0;
+    world.forEachEntity<const Sparse>([&sparseVisits](const Sparse&) { sparseVisits++; });
+    if (sparseVisits != sparseCount)
+        fail("snapshot: {} entities with Sparse, expected {}\n", sparseVisits, sparseCount);
+
+    // Restored components count as changed
+    size_t changed = 0;
+    world.forEachChanged<const A>(since, [&changed](const A&) { changed++; });
+    if (changed != validCount)
+        fail("snapshot: {} changed A, expected {}\n", changed, validCount);
+
+    // The free list is restored too
+    const auto first = world.createEntity().getId();
+    const auto second = world.createEntity().getId();
+    const auto third = world.createEntity().getId();
+    if (first != 30 || second != 70 || third != count)
+        fail("snapshot: new ids {}, {}, {}, expected 30, 70, {}\n", first, second, third, count);
+
+    ecs::World noCopyWorld;
+    noCopyWorld.createEntity().add<NoCopy>();
+    ecs::World::Snapshot noCopySnapshot;
+    if (noCopyWorld.saveSnapshot(noCopySnapshot))
+        fail("snapshot: saved a component that can not be copied\n");
+}
+
+// Destroyed ids are reused lowest first, no matter in which order they were destroyed
+void testIdReuse()
+{
+    ecs::World world;
+    for (size_t i = 0; i < 200; ++i)
+        world.createEntity().add<A>(A { static_cast<int>(i) });
+    world.flush();
+    const std::vector<ecs::EntityId> destroyed = { 150, 3, 64, 199, 0, 63 };
+    for (const auto id : destroyed)
+        world.destroyEntity(id);
+
+    for (const auto expected : { 0u, 3u, 63u, 64u, 150u, 199u, 200u }) {
+        const auto id = world.createEntity().getId();
+        if (id != expected)
+            fail("id reuse: got id {}, expected {}\n", id, expected);
+    }
+}
+
+// After clear the world has to behave like a new one, except that the versions keep increasing,
+// so changes from before can't be mistaken for new ones and new ones are not missed
+void testClear()
+{
+    ecs::World world;
+    for (size_t i = 0; i < 100; ++i) {
+        auto entity = world.createEntity();
+        entity.add<A>(A { static_cast<int>(i) });
+        if (i % 2 == 0)
+            entity.add<B>(B { static_cast<int>(i) });
+        if (i % 10 == 0)
+            entity.add<Sparse>(Sparse { static_cast<int>(i) });
+    }
+    world.flush();
+    // Cache the queries
+    world.forEachEntity<const A>([](const A&) {});
+    world.forEachEntity<const A, const B>([](const A&, const B&) {});
+    world.destroyEntity(5);
+    world.destroyEntity(2);
+    const auto since = world.advanceVersion();
+
+    world.clear();
+    if (world.getEntityCount() != 0)
+        fail("clear: {} entities left\n", world.getEntityCount());
+    size_t visits = 0;
+    world.forEachEntity<const A>([&visits](const A&) { visits++; });
+    world.forEachEntity<const Sparse>([&visits](const Sparse&) { visits++; });
+    world.forEachChanged<const A>(0, [&visits](const A&) { visits++; });
+    world.forEachChanged<const Sparse>(0, [&visits](const Sparse&) { visits++; });
+    if (visits != 0)
+        fail("clear: {} components left\n", visits);
+
+    // Ids start at 0 again and the free list is empty
+    for (ecs::EntityId i = 0; i < 10; ++i) {
+        auto entity = world.createEntity();
+        if (entity.getId() != i)
+            fail("clear: got id {}, expected {}\n", entity.getId(), i);
+        if (world.getComponentMask(entity.getId()) != ecs::ComponentMask())
+            fail("clear: entity {} has components\n", entity.getId());
+        entity.add<A>(A { static_cast<int>(i) });
+        if (i < 3)
+            entity.add<B>(B { static_cast<int>(i) });
+    }
+    world.flush();
+
+    size_t a = 0, ab = 0, changed = 0;
+    world.forEachEntity<const A>([&a](const A&) { a++; });
+    world.forEachEntity<const A, const B>([&ab](const A&, const B&) { ab++; });
+    world.forEachChanged<const A>(since, [&changed](const A&) { changed++; });
+    if (a != 10 || ab != 3)
+        fail("clear: {} entities with A and {} with A and B, expected 10 and 3\n", a, ab);
+    if (changed != 10)
+        fail("clear: {} changed entities, expected 10\n", changed);
+}
+
+template <typename ComponentType>
+std::vector<ecs::EntityId> getChanged(ecs::World& world, ecs::Version since)
+{
+    std::vector<ecs::EntityId> ids;
+    world.forEachChanged<const ComponentType>(
+        since, [&ids](ecs::EntityHandle entity) { ids.push_back(entity.getId()); });
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+template <typename ComponentType>
+void checkChanged(ecs::World& world, ecs::Version since,
+    const std::vector<ecs::EntityId>& expected, const char* name)
+{
+    const auto changed = getChanged<ComponentType>(world, since);
+    if (changed != expected)
+        fail("versions: {}: {} changed components, expected {}\n", name, changed.size(),
+            expected.size());
+    for (const auto id : expected) {
+        if (!world.hasChanged<ComponentType>(id, since))
+            fail("versions: {}: entity {} has not changed\n", name, id);
+    }
+}
+
+// The same for both pool types. transformSystem relies on all of this.
+template <typename ComponentType>
+void testVersions()
+{
+    ecs::World world;
+    for (size_t i = 0; i < 100; ++i) {
+        auto entity = world.createEntity();
+        entity.add<ComponentType>(ComponentType { static_cast<int>(i) });
+        if (i % 2 == 0)
+            entity.add<B>(B { static_cast<int>(i) });
+    }
+    world.flush();
+    if (getChanged<ComponentType>(world, 0).size() != 100)
+        fail("versions: not every component has changed since 0\n");
+
+    // Set
+    auto since = world.advanceVersion();
+    checkChanged<ComponentType>(world, since, {}, "nothing");
+    world.getComponent<const ComponentType>(3);
+    world.forEachEntity<const ComponentType>([](const ComponentType&) {});
+    checkChanged<ComponentType>(world, since, {}, "const access");
+    if (world.hasChanged<ComponentType>(3, since))
+        fail("versions: const access changed the version\n");
+    world.getComponent<ComponentType>(70).value++;
+    world.getComponent<ComponentType>(5).value++;
+    checkChanged<ComponentType>(world, since, { 5, 70 }, "set");
+
+    // Mutable iteration
+    since = world.advanceVersion();
+    world.forEachEntity<ComponentType, const B>([](ComponentType&, const B&) {});
+    std::vector<ecs::EntityId> even;
+    for (ecs::EntityId id = 0; id < 100; id += 2)
+        even.push_back(id);
+    checkChanged<ComponentType>(world, since, even, "mutable iteration");
+
+    // Add
+    since = world.advanceVersion();
+    const auto added = world.createEntity().getId();
+    world.addComponent<ComponentType>(added, ComponentType { 0 });
+    world.addComponent<B>(1, B { 1 });
+    checkChanged<ComponentType>(world, since, { added }, "add");
+    checkChanged<B>(world, since, { 1 }, "add other component");
+    world.flush();
+
+    // Remove
+    since = world.advanceVersion();
+    world.getComponent<ComponentType>(7).value++;
+    world.removeComponent<ComponentType>(7);
+    world.getComponent<ComponentType>(9).value++;
+    world.destroyEntity(9);
+    world.getComponent<ComponentType>(11).value++;
+    checkChanged<ComponentType>(world, since, { 11 }, "remove");
+
+    // Restore, everything might be different from before
+    ecs::World::Snapshot snapshot;
+    world.saveSnapshot(snapshot);
+    since = world.advanceVersion();
+    world.restoreSnapshot(snapshot);
+    std::vector<ecs::EntityId> all;
+    world.forEachEntity<const ComponentType>(
+        [&all](ecs::EntityHandle entity) { all.push_back(entity.getId()); });
+    std::sort(all.begin(), all.end());
+    checkChanged<ComponentType>(world, since, all, "restore");
+
+    // The versions are still monotonic after a restore
+    since = world.advanceVersion();
+    world.getComponent<ComponentType>(13).value++;
+    checkChanged<ComponentType>(world, since, { 13 }, "set after restore");
+}
+
+// Removing from a SparseComponentPool moves the last component into the hole, which must not
+// mix up the components of different entities
+void testSparsePool()
+{
+    ecs::SparseComponentPool<Sparse> pool;
+    for (ecs::EntityId id = 0; id < 10; ++id)
+        pool.add(id, 1, Sparse { static_cast<int>(id) * 10 });
+    for (const auto id : { 9u, 0u, 5u })
+        pool.remove(id);
+    for (ecs::EntityId id = 0; id < 10; ++id) {
+        const auto removed = id == 0 || id == 5 || id == 9;
+        if (pool.has(id) == removed)
+            fail("sparse pool: entity {} has component: {}\n", id, pool.has(id));
+        else if (!removed && pool.get(id).value != static_cast<int>(id) * 10)
+            fail("sparse pool: entity {} has value {}\n", id, pool.get(id).value);
+    }
+    pool.add(5, 2, Sparse { 50 });
+    std::vector<int> visits(10, 0);
+    pool.forEachChanged(0, [&visits](ecs::EntityId id) { visits[id]++; });
+    checkVisits(visits, { 0, 1, 1, 1, 1, 1, 1, 1, 1, 0 }, "sparse pool");
+    if (pool.get(5).value != 50 || pool.getVersion(5) != 2)
+        fail("sparse pool: re-added component is wrong\n");
+}
+
+// Every third entity has Sparse with the same value as A
+void addSparse(ecs::World& world, const std::vector<ecs::EntityId>& ids)
+{
+    for (const auto id : ids) {
+        if (id % 3 == 0)
+            world.addComponent<Sparse>(id, Sparse { world.getComponent<const A>(id).value });
+    }
+}
+
+std::vector<int> getSparseExpected(const std::vector<ecs::EntityId>& ids)
+{
+    std::vector<int> expected(ids.size(), 0);
+    for (const auto id : ids)
+        expected[id] = id % 3 == 0 ? 1 : 0;
+    return expected;
+}
+
+// The archetypes of sparse components are iterated like dense ones, while the components are
+// swapped around in the pool
+void testSparse()
+{
+    ecs::World world;
+    const auto ids = createEntities(world, 100);
+    addSparse(world, ids);
+
+    // Mixed queries
+    std::vector<int> visits(ids.size(), 0);
+    world.forEachEntity<const A, const Sparse>([&visits](const A& a, const Sparse& sparse) {
+        if (a.value != sparse.value)
+            fail("sparse: entity {} has value {}\n", a.value, sparse.value);
+        visits[a.value]++;
+    });
+    checkVisits(visits, getSparseExpected(ids), "sparse mixed query");
+
+    // Remove the visited component
+    visits.assign(ids.size(), 0);
+    world.forEachEntity<const A, const Sparse>(
+        [&visits](ecs::EntityHandle entity, const A& a, const Sparse& sparse) {
+            if (a.value != sparse.value)
+                fail("sparse: entity {} has value {}\n", a.value, sparse.value);
+            visits[a.value]++;
+            entity.remove<Sparse>();
+        });
+    checkVisits(visits, getSparseExpected(ids), "sparse remove visited");
+    size_t count = 0;
+    world.forEachEntity<const Sparse>([&count](const Sparse&) { count++; });
+    world.forEachChanged<const Sparse>(0, [&count](const Sparse&) { count++; });
+    if (count != 0)
+        fail("sparse: {} components left after removing all\n", count);
+    count = 0;
+    world.forEachEntity<const A>([&count](const A&) { count++; });
+    if (count != ids.size())
+        fail("sparse: {} entities with A left, expected {}\n", count, ids.size());
+
+    // Remove components that were not visited yet, which moves the ones that were
+    addSparse(world, ids);
+    visits.assign(ids.size(), 0);
+    auto expected = getSparseExpected(ids);
+    world.forEachEntity<const A, const Sparse>([&](const A& a, const Sparse& sparse) {
+        if (a.value != sparse.value)
+            fail("sparse: entity {} has value {}\n", a.value, sparse.value);
+        visits[a.value]++;
+        for (const auto id : ids) {
+            if (world.hasComponents<Sparse>(id) && visits[id] == 0) {
+                world.removeComponent<Sparse>(id);
+                expected[id] = 0;
+                break;
+            }
+        }
+    });
+    checkVisits(visits, expected, "sparse remove unvisited");
+
+    // Removing the current component while walking the changes
+    const auto since = world.advanceVersion();
+    world.forEachEntity<Sparse>([](Sparse&) {});
+    visits.assign(ids.size(), 0);
+    world.forEachChanged<const Sparse>(since, [&visits](ecs::EntityHandle entity) {
+        visits[entity.getId()]++;
+        entity.remove<Sparse>();
+    });
+    checkVisits(visits, expected, "sparse remove changed");
+}
+}
+
+int main(int, char**)
+{
+    testAddComponent();
+    testRemoveComponent();
+    testDestroyEntity();
+    testCreateEntity();
+    testCreateEntities();
+    testSnapshot();
+    testIdReuse();
+    testClear();
+    testVersions<A>();
+    testVersions<Sparse>();
+    testSparsePool();
+    testSparse();
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "net.hpp"
+
+// libFuzzer entry point (COMPLEXITY_ENABLE_FUZZER). The input is a packet as Client/Server::receive
+// get it. Every message in it is decoded as every message type, not just the one in its header,
+// so the fuzzer doesn't need to find the type ids first. Decoded messages are serialized again,
+// which must not assert either.
+
+namespace {
+template <MessageType MsgType>
+void fuzzMessage(ReadBuffer buffer)
+{
+    const auto size = buffer.getLeft();
+    Message<MsgType> message;
+    if (!deserialize<BitReadStream>(buffer, message))
+        return;
+    assert(buffer.getCursor() <= size);
+
+    const auto maxSize = getMaxMessageSize(MsgType);
+    WriteBuffer out(size);
+    if (!serialize<BitWriteStream>(out, message))
+        std::abort();
+    if (maxSize > 0 && out.getSize() > maxSize)
+        std::abort();
+}
+
+template <size_t... Indices>
+void fuzzMessages(const ReadBuffer& buffer, std::index_sequence<Indices...>)
+{
+    // Every one gets a copy that starts at the beginning of the message
+    (fuzzMessage<static_cast<MessageType>(Indices)>(buffer), ...);
+}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    forEachMessage(data, size, [](uint32_t, MessageType, ReadBuffer& buffer) {
+        fuzzMessages(buffer, std::make_index_sequence<MessageTypeCount>());
+    });
+    return 0;
+}
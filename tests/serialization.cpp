@@ -1,5 +1,27 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <utility>
+
+#include <fmt/format.h>
+#include <glm/gtc/constants.hpp>
+
+#include "net.hpp"
 #include "serialization.hpp"
 
+namespace {
+int failures = 0;
+
+template <typename... Args>
+void fail(Args&&... args)
+{
+    fmt::print(stderr, std::forward<Args>(args)...);
+    ++failures;
+}
+}
+
 struct A {
     int y;
 
@@ -70,38 +92,482 @@ struct ServerPlayerStateUpdate {
     }
 };
 
-int main(int, char**)
+struct Packed {
+    bool flag;
+    int health;
+    float throttle;
+
+    SERIALIZE()
+    {
+        FIELD(flag);
+        FIELD_RANGED(health, 0, 100);
+        FIELD_QFLOAT(throttle, 0.0f, 1.0f, 0.01f);
+        SERIALIZE_END;
+    }
+};
+
+struct Quantized {
+    float f;
+    glm::vec3 v;
+
+    SERIALIZE()
+    {
+        FIELD_QFLOAT(f, -10.0f, 10.0f, 0.01f);
+        FIELD_QFLOAT(v, glm::vec3(-1.0f, 0.0f, -100.0f), glm::vec3(1.0f, 50.0f, 100.0f), 0.001f);
+        SERIALIZE_END;
+    }
+};
+
+struct Orientation {
+    glm::quat q;
+
+    SERIALIZE()
+    {
+        FIELD_QUAT(q);
+        SERIALIZE_END;
+    }
+};
+
+// The bits before a string are padded to a whole byte
+struct Strings {
+    bool flag;
+    int small;
+    std::string_view first;
+    bool other;
+    std::string_view second;
+
+    SERIALIZE()
+    {
+        FIELD(flag);
+        FIELD_RANGED(small, 0, 4);
+        FIELD(first);
+        FIELD(other);
+        FIELD(second);
+        SERIALIZE_END;
+    }
+};
+
+template <typename WStream, typename RStream, typename T>
+bool roundTrip(T& src, T& dst, WriteBuffer& wbuf)
+{
+    wbuf.clear();
+    if (!serialize<WStream>(wbuf, src))
+        return false;
+    ReadBuffer rbuf(wbuf.getData(), wbuf.getSize());
+    return deserialize<RStream>(rbuf, dst) && rbuf.getLeft() == 0;
+}
+
+bool near(float a, float b, float tolerance)
+{
+    return std::abs(a - b) <= tolerance;
+}
+
+bool near(const glm::vec3& a, const glm::vec3& b, float tolerance)
+{
+    return near(a.x, b.x, tolerance) && near(a.y, b.y, tolerance) && near(a.z, b.z, tolerance);
+}
+
+// q and -q are the same rotation
+bool sameRotation(const glm::quat& a, const glm::quat& b)
+{
+    return std::abs(glm::dot(a, b)) > 0.9999f;
+}
+
+struct Floats {
+    float f;
+    glm::vec3 v;
+    glm::quat q;
+
+    SERIALIZE()
+    {
+        FIELD(f);
+        FIELD(v);
+        FIELD(q);
+        SERIALIZE_END;
+    }
+};
+
+struct Varints {
+    uint32_t u;
+    int32_t i;
+    int8_t small;
+    std::vector<uint8_t> bytes;
+
+    SERIALIZE()
+    {
+        FIELD_VARINT(u);
+        FIELD_VARINT(i);
+        FIELD_VARINT(small);
+        FIELD_VEC(bytes);
+        SERIALIZE_END;
+    }
+};
+
+template <typename WStream, typename RStream>
+void testVarints(const char* name)
+{
+    const std::vector<uint32_t> us = { 0, 1, 127, 128, 16383, 16384, 0xffffffff };
+    const std::vector<int32_t> is = { 0, -1, 1, -64, 64, -2147483647 - 1, 2147483647 };
+    for (size_t n = 0; n < us.size(); ++n) {
+        Varints src { us[n], is[n], static_cast<int8_t>(is[n] % 128),
+            std::vector<uint8_t>(n * 100, static_cast<uint8_t>(n)) };
+        WriteBuffer wbuf(1024);
+        if (!serialize<WStream>(wbuf, src))
+            fail("Error serializing varints ({})\n", name);
+        ReadBuffer rbuf(wbuf.getData(), wbuf.getSize());
+        Varints dst;
+        if (!deserialize<RStream>(rbuf, dst) || dst.u != src.u || dst.i != src.i
+            || dst.small != src.small || dst.bytes != src.bytes)
+            fail("Varints ({}) did not round trip: {}, {}\n", name, src.u, src.i);
+    }
+
+    // 2^32 does not fit
+    const std::vector<uint8_t> tooLarge = { 0x80, 0x80, 0x80, 0x80, 0x10 };
+    ReadBuffer rbuf(tooLarge.data(), tooLarge.size());
+    RStream stream(rbuf);
+    uint32_t u = 0;
+    if (serializeVarint(stream, u))
+        fail("Decoded overlong varint ({})\n", name);
+}
+
+// Compares against shifts, which don't depend on the endianness of the host. Vector components
+// have to be big endian like scalar floats.
+void testByteOrder()
+{
+    Floats src { 1.5f, glm::vec3(-2.0f, 0.25f, 1e6f), glm::quat(0.5f, -0.5f, 0.5f, -0.5f) };
+    WriteBuffer wbuf(64);
+    if (!serialize<WriteStream>(wbuf, src)) {
+        fail("Error serializing floats\n");
+        return;
+    }
+    const float values[] = { src.f, src.v.x, src.v.y, src.v.z, src.q.x, src.q.y, src.q.z, src.q.w };
+    if (wbuf.getSize() != sizeof(values)) {
+        fail("Floats have {} bytes, expected {}\n", wbuf.getSize(), sizeof(values));
+        return;
+    }
+    for (size_t i = 0; i < std::size(values); ++i) {
+        uint32_t bits = 0;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+        for (size_t b = 0; b < 4; ++b) {
+            if (wbuf.getData()[i * 4 + b] != static_cast<uint8_t>(bits >> ((3 - b) * 8)))
+                fail("Float {} is not in network byte order\n", i);
+        }
+    }
+}
+
+// Acks come from clients, so the server must not use frames it does not have or that would give
+// a delta with an age of 0
+void testPlayerStateAcks()
+{
+    using PlayerState = Message<MessageType::ServerPlayerStateUpdate>::PlayerState;
+    PlayerStateHistory history;
+    const uint32_t frame = 100;
+    for (uint32_t f = 0; f <= frame; ++f)
+        history.add(f, { PlayerState { 1, glm::vec3(static_cast<float>(f)), glm::quat() } });
+
+    const uint32_t oldest = frame - PlayerStateHistory::Size + 1;
+    for (const auto ack : { frame, frame + 1, oldest - 1, InvalidFrame }) {
+        if (history.findBaseline(frame, ack))
+            fail("Frame {} is not a valid baseline for frame {}\n", ack, frame);
+    }
+    for (const auto ack : { frame - 1, oldest }) {
+        const auto baseline = history.findBaseline(frame, ack);
+        if (!baseline) {
+            fail("Frame {} is a valid baseline for frame {}\n", ack, frame);
+            continue;
+        }
+        const auto delta = makePlayerStateDelta(frame, ack, baseline, *history.find(frame));
+        if (delta.getBaselineFrame(frame) != ack)
+            fail("Wrong baseline age {} for frame {}\n", delta.baselineAge, ack);
+    }
+}
+
+// A client that lost more updates in a row than the history holds, acks a slot the server resolves
+// to a frame the client never received. It has to recover by acking nothing for a while.
+void testLostPlayerStates()
+{
+    using PlayerState = Message<MessageType::ServerPlayerStateUpdate>::PlayerState;
+    using ClientMoveUpdate = Message<MessageType::ClientMoveUpdate>;
+    const uint32_t lostBegin = 50;
+    const uint32_t lostEnd = lostBegin + playerStateHistorySize + 8;
+    // Frames until an ack reaches the server
+    const size_t ackDelay = 3;
+
+    PlayerStateHistory history;
+    PlayerStateReceiver receiver;
+    std::deque<uint8_t> ackedSlots(ackDelay, playerStateHistorySize);
+    uint32_t recovered = InvalidFrame;
+    for (uint32_t frame = 1; frame < lostEnd + 20; ++frame) {
+        const PlayerStateList players = {
+            PlayerState { 1, glm::vec3(static_cast<float>(frame), 0.0f, 0.0f), glm::quat() },
+            PlayerState { 2, glm::vec3(0.0f), glm::quat() },
+        };
+        history.add(frame, players);
+        const auto acked = ClientMoveUpdate { glm::vec3(0.0f), glm::quat(), ackedSlots.front() }
+                               .getAckedFrame(frame);
+        ackedSlots.pop_front();
+        const auto baseline = history.findBaseline(frame, acked);
+        const auto message
+            = makePlayerStateDelta(frame, baseline ? acked : InvalidFrame, baseline, players);
+
+        if (frame < lostBegin || frame >= lostEnd) {
+            const auto received = receiver.receive(frame, message);
+            if (received) {
+                if (received->size() != 2 || (*received)[0].position != players[0].position)
+                    fail("Player states of frame {} were decoded wrong\n", frame);
+                if (frame >= lostEnd && recovered == InvalidFrame)
+                    recovered = frame;
+            } else if (frame < lostBegin || recovered != InvalidFrame) {
+                fail("Player states of frame {} were not decoded\n", frame);
+            }
+        }
+        ackedSlots.push_back(receiver.getAckedSlot());
+    }
+    if (recovered == InvalidFrame || recovered > lostEnd + 2 * ackDelay + 1)
+        fail("Client did not recover after losing updates (first decoded frame: {})\n", recovered);
+}
+
+// The ack is sent modulo the history size and the server picks the newest frame it can refer to
+void testAckedSlots()
+{
+    using ClientMoveUpdate = Message<MessageType::ClientMoveUpdate>;
+    for (const uint32_t frame : { 1u, 5u, 31u, 32u, 33u, 100u, 100000u }) {
+        for (uint32_t age = 1; age <= playerStateHistorySize && age <= frame; ++age) {
+            const auto acked = frame - age;
+            ClientMoveUpdate src { glm::vec3(0.0f), glm::quat(),
+                ClientMoveUpdate::getAckedSlot(acked) };
+            WriteBuffer wbuf(64);
+            if (!serialize<BitWriteStream>(wbuf, src))
+                fail("Error serializing move update\n");
+            ReadBuffer rbuf(wbuf.getData(), wbuf.getSize());
+            ClientMoveUpdate dst;
+            if (!deserialize<BitReadStream>(rbuf, dst) || dst.getAckedFrame(frame) != acked)
+                fail("Acked frame {} did not round trip in frame {}\n", acked, frame);
+        }
+    }
+
+    ClientMoveUpdate none { glm::vec3(0.0f), glm::quat(),
+        ClientMoveUpdate::getAckedSlot(InvalidFrame) };
+    if (none.getAckedFrame(100) != InvalidFrame)
+        fail("Missing ack was not InvalidFrame\n");
+    // Slot 5 can only refer to frames >= 5
+    ClientMoveUpdate early { glm::vec3(0.0f), glm::quat(), 5 };
+    if (early.getAckedFrame(3) != InvalidFrame || early.getAckedFrame(0) != InvalidFrame)
+        fail("Ack before the first frame was not InvalidFrame\n");
+}
+
+void testNetPositionClamp()
+{
+    bool outside = false;
+    const glm::vec3 inside(0.0f, 1.0f, 2.0f);
+    if (clampNetPosition(inside, outside) != inside || outside)
+        fail("Position inside of the bounds was changed\n");
+    const auto clamped = clampNetPosition(netPositionMax + glm::vec3(1.0f, 0.0f, 0.0f), outside);
+    if (clamped != netPositionMax || !outside)
+        fail("Position outside of the bounds was not clamped\n");
+    clampNetPosition(inside, outside);
+    if (outside)
+        fail("Position inside of the bounds again was not reset\n");
+}
+
+void testBytes()
 {
     WriteBuffer wbuf(1024);
     B src { 69, 0x12345678, -589589, 89.484f, glm::vec3(3.0, 4.0f, 2.0), A { 12 },
         { A { 59 }, A { 68 }, A { 92 }, A { 39 } }, { 5, 753, 8493, 8, 482948, 999 } };
-    if (!serialize(wbuf, src))
-        fmt::print(stderr, "Error serializing\n");
+    B dst {};
+    if (!roundTrip<WriteStream, ReadStream>(src, dst, wbuf)) {
+        fail("Error serializing B\n");
+        return;
+    }
+    bool asEqual = dst.as.size() == src.as.size();
+    for (size_t i = 0; asEqual && i < src.as.size(); ++i)
+        asEqual = dst.as[i].y == src.as[i].y;
+    if (dst.c != src.c || dst.u != src.u || dst.x != src.x || dst.f != src.f || dst.v != src.v
+        || dst.a.y != src.a.y || !asEqual || dst.is != src.is)
+        fail("B did not round trip\n");
 
-    fmt::print("data: ");
-    for (size_t i = 0; i < wbuf.getSize(); ++i)
-        fmt::print("{:02x} ", wbuf.getData()[i]);
-    fmt::print("\n");
+    ServerPlayerStateUpdate psu;
+    ServerPlayerStateUpdate psuDst;
+    if (!roundTrip<WriteStream, ReadStream>(psu, psuDst, wbuf) || !psuDst.players.empty())
+        fail("Empty vector did not round trip\n");
 
+    // Vector components are big endian like scalars
+    std::vector<glm::vec3> vecs(20, glm::vec3(1.0f, -2.0f, 0.5f));
+    wbuf.clear();
+    WriteStream vecStream(wbuf);
+    vecStream.serializeVector(vecs);
+    const uint8_t expected[] = { 20, 0x3f, 0x80, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00, 0x3f };
+    if (wbuf.getSize() != 1 + 20 * 12 || std::memcmp(wbuf.getData(), expected, sizeof(expected)))
+        fail("Wrong vec3 encoding\n");
     ReadBuffer rbuf(wbuf.getData(), wbuf.getSize());
-    B dst;
-    if (!deserialize(rbuf, dst)) {
-        fmt::print(stderr, "Error deserializing\n");
-    } else {
-        fmt::print("B = {{c = {}, u = {:x}, x = {}, f = {}, v = {}, a = {{y = {}}} }}\n", dst.c,
-            dst.u, dst.x, dst.f, dst.v, dst.a.y);
-        for (size_t i = 0; i < dst.as.size(); ++i)
-            fmt::print("B.as[{}].y = {}\n", i, dst.as[i].y);
-        for (size_t i = 0; i < dst.is.size(); ++i)
-            fmt::print("B.is[{}].y = {}\n", i, dst.is[i]);
+    ReadStream vecReadStream(rbuf);
+    std::vector<glm::vec3> vecsDst;
+    if (!vecReadStream.serializeVector(vecsDst) || vecsDst != vecs)
+        fail("vec3 vector did not round trip\n");
+}
+
+void testBits()
+{
+    WriteBuffer wbuf(64);
+    Packed packed { true, 73, 0.25f };
+    Packed packedDst {};
+    // 1 + 7 + 7 bits
+    if (!roundTrip<BitWriteStream, BitReadStream>(packed, packedDst, wbuf)
+        || wbuf.getSize() != 2)
+        fail("Error serializing packed\n");
+    else if (packedDst.flag != packed.flag || packedDst.health != packed.health
+        || !near(packedDst.throttle, packed.throttle, 0.005f))
+        fail("Packed did not round trip\n");
+
+    // Out of range values are clamped
+    const glm::vec3 min(-1.0f, 0.0f, -100.0f);
+    const glm::vec3 max(1.0f, 50.0f, 100.0f);
+    const std::vector<std::pair<Quantized, Quantized>> quantized = {
+        { Quantized { -10.0f, min }, Quantized { -10.0f, min } },
+        { Quantized { 10.0f, max }, Quantized { 10.0f, max } },
+        { Quantized { 0.0f, glm::vec3(0.0f, 25.0f, 0.0f) },
+            Quantized { 0.0f, glm::vec3(0.0f, 25.0f, 0.0f) } },
+        { Quantized { 3.14159f, glm::vec3(0.123f, 1.0f / 3.0f, -42.4242f) },
+            Quantized { 3.14159f, glm::vec3(0.123f, 1.0f / 3.0f, -42.4242f) } },
+        { Quantized { -20.0f, min - 1.0f }, Quantized { -10.0f, min } },
+        { Quantized { 20.0f, max + 1.0f }, Quantized { 10.0f, max } },
+    };
+    for (auto [src, expected] : quantized) {
+        Quantized dst {};
+        if (!roundTrip<BitWriteStream, BitReadStream>(src, dst, wbuf))
+            fail("Error serializing quantized {}\n", src.f);
+        // Half a step and some float error
+        else if (!near(dst.f, expected.f, 0.0051f) || !near(dst.v, expected.v, 0.00051f))
+            fail("Quantized {} did not round trip: {}\n", src.f, dst.f);
     }
 
-    ServerPlayerStateUpdate psu;
-    wbuf.clear();
-    if (!serialize(wbuf, psu))
-        fmt::print(stderr, "Error serializing psu\n");
-    ReadBuffer rbuf2(wbuf.getData(), wbuf.getSize());
-    if (!deserialize(rbuf2, psu))
-        fmt::print(stderr, "Error deserializing\n");
-    return 0;
+    const std::vector<glm::quat> quats = {
+        glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+        glm::quat(-1.0f, 0.0f, 0.0f, 0.0f),
+        glm::angleAxis(glm::half_pi<float>(), glm::vec3(1.0f, 0.0f, 0.0f)),
+        glm::angleAxis(-glm::half_pi<float>(), glm::vec3(0.0f, 1.0f, 0.0f)),
+        glm::angleAxis(glm::pi<float>(), glm::vec3(0.0f, 0.0f, 1.0f)),
+        glm::angleAxis(2.0f, glm::normalize(glm::vec3(1.0f, -2.0f, 3.0f))),
+        glm::normalize(glm::quat(0.5f, -0.5f, 0.5f, -0.5f)),
+        glm::normalize(glm::quat(0.1f, -0.9f, 0.3f, 0.2f)),
+    };
+    for (const auto& q : quats) {
+        Orientation src { q };
+        Orientation dst {};
+        // 2 + 3 * 9 bits
+        if (!roundTrip<BitWriteStream, BitReadStream>(src, dst, wbuf) || wbuf.getSize() != 4)
+            fail("Error serializing quaternion\n");
+        else if (!sameRotation(dst.q, q) || !near(glm::length(dst.q), 1.0f, 0.001f))
+            fail("Quaternion ({}, {}, {}, {}) did not round trip\n", q.w, q.x, q.y, q.z);
+    }
+    Orientation zero { glm::quat(0.0f, 0.0f, 0.0f, 0.0f) };
+    Orientation zeroDst {};
+    if (!roundTrip<BitWriteStream, BitReadStream>(zero, zeroDst, wbuf)
+        || !sameRotation(zeroDst.q, glm::quat(1.0f, 0.0f, 0.0f, 0.0f)))
+        fail("Zero quaternion was not sent as identity\n");
+}
+
+void testStringViews()
+{
+    WriteBuffer wbuf(64);
+    Strings src { true, 3, "terminal", true, "" };
+    Strings dst {};
+    if (!roundTrip<BitWriteStream, BitReadStream>(src, dst, wbuf)) {
+        fail("Error serializing strings\n");
+        return;
+    }
+    if (dst.flag != src.flag || dst.small != src.small || dst.first != src.first
+        || dst.other != src.other || dst.second != src.second)
+        fail("Strings did not round trip\n");
+    // 1 + 3 + 8 bits are padded to 2 bytes, then the characters, then 1 + 8 bits padded again
+    const auto data = reinterpret_cast<const char*>(wbuf.getData());
+    if (wbuf.getSize() != 2 + src.first.size() + 2 || dst.first.data() != data + 2
+        || std::memcmp(data + 2, "terminal", 8) != 0)
+        fail("Wrong string padding\n");
+
+    // The views point into the packet, which is shorter than the string claims
+    ReadBuffer truncated(wbuf.getData(), 5);
+    Strings truncatedDst {};
+    if (deserialize<BitReadStream>(truncated, truncatedDst))
+        fail("Decoded truncated string\n");
+}
+
+// Sends a few frames from a server to a client that acknowledges every one
+void testPlayerStateDelta()
+{
+    using Update = Message<MessageType::ServerPlayerStateUpdate>;
+    using PlayerState = Update::PlayerState;
+    const auto identity = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    const auto turned = glm::angleAxis(0.5f, glm::vec3(0.0f, 1.0f, 0.0f));
+    const std::vector<PlayerStateList> frames = {
+        { PlayerState { 1, glm::vec3(1.0f, 2.0f, 3.0f), identity },
+            PlayerState { 2, glm::vec3(4.0f, 5.0f, 6.0f), turned } },
+        // 1 moved
+        { PlayerState { 1, glm::vec3(1.5f, 2.0f, 3.0f), identity },
+            PlayerState { 2, glm::vec3(4.0f, 5.0f, 6.0f), turned } },
+        // 1 turned, 2 left and 3 joined
+        { PlayerState { 1, glm::vec3(1.5f, 2.0f, 3.0f), turned },
+            PlayerState { 3, glm::vec3(-1.0f, 0.0f, 1.0f), identity } },
+        // Nothing changed
+        { PlayerState { 1, glm::vec3(1.5f, 2.0f, 3.0f), turned },
+            PlayerState { 3, glm::vec3(-1.0f, 0.0f, 1.0f), identity } },
+    };
+    const std::vector<size_t> expectedPlayers = { 2, 1, 2, 0 };
+
+    PlayerStateHistory server;
+    PlayerStateHistory client;
+    WriteBuffer wbuf(256);
+    for (uint32_t frame = 0; frame < frames.size(); ++frame) {
+        const auto& players = frames[frame];
+        server.add(frame, players);
+        const auto ack = frame > 0 ? frame - 1 : InvalidFrame;
+        auto src = makePlayerStateDelta(frame, ack, server.findBaseline(frame, ack), players);
+        Update dst;
+        if (!roundTrip<BitWriteStream, BitReadStream>(src, dst, wbuf)) {
+            fail("Error serializing player state update {}\n", frame);
+            return;
+        }
+        if (dst.players.size() != expectedPlayers[frame])
+            fail("Update {} contains {} players, expected {}\n", frame, dst.players.size(),
+                expectedPlayers[frame]);
+
+        PlayerStateList decoded;
+        if (!applyPlayerStateDelta(client.find(dst.getBaselineFrame(frame)), dst, decoded)) {
+            fail("Could not apply player state update {}\n", frame);
+            return;
+        }
+        bool equal = decoded.size() == players.size();
+        for (const auto& player : players) {
+            const auto it = std::find_if(decoded.begin(), decoded.end(),
+                [&player](const PlayerState& other) { return other.id == player.id; });
+            equal = equal && it != decoded.end() && near(it->position, player.position, 0.0006f)
+                && sameRotation(it->orientation, player.orientation);
+        }
+        if (!equal)
+            fail("Player state update {} did not round trip\n", frame);
+        client.add(frame, decoded);
+
+        if (frame > 0 && applyPlayerStateDelta(nullptr, dst, decoded))
+            fail("Applied player state update {} without baseline\n", frame);
+    }
+}
+
+int main(int, char**)
+{
+    testBytes();
+    testBits();
+    testStringViews();
+
+    testByteOrder();
+
+    testVarints<WriteStream, ReadStream>("bytes");
+    testVarints<BitWriteStream, BitReadStream>("bits");
+
+    testPlayerStateDelta();
+    testPlayerStateAcks();
+    testAckedSlots();
+    testLostPlayerStates();
+    testNetPositionClamp();
+    return failures > 0 ? 1 : 0;
 }